@@ -0,0 +1,40 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "../include/filetype.h"
+#include <stddef.h>
+
+// Path cache: FUSE hands every handler a full path, so lookups of the same path skip
+// the walk from root. An entry maps a path to its node or records that it does not
+// exist. The handlers that change the namespace drop the paths they touch, a freed
+// node takes its entries with it. Protected by fs_lock like the tree itself.
+
+#define DEFAULT_DCACHE_SIZE 4096  // Cached paths before the least recently used is dropped
+
+typedef struct dentry dentry;
+
+typedef struct dcache_stats {
+    long hits;           // Lookups answered with a node
+    long negative_hits;  // Lookups answered with "does not exist"
+    long misses;         // Lookups that walked the tree
+    long evictions;      // Entries dropped to stay within the size
+    long invalidations;  // Entries dropped by namespace changes
+} dcache_stats;
+
+int dcache_lookup(const char *path, size_t len, filetype **node);
+
+void dcache_insert(const char *path, size_t len, filetype *node);
+
+void dcache_invalidate(const char *path);
+
+void dcache_invalidate_prefix(const char *path);
+
+void dcache_forget_node(filetype *node);
+
+void dcache_clear();
+
+dcache_stats dcache_get_stats();
+
+void dcache_close();
+
+#endif
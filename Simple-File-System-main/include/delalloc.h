@@ -0,0 +1,31 @@
+#ifndef DELALLOC_H
+#define DELALLOC_H
+
+#include "../include/filetype.h"
+#include <stdint.h>
+
+// Delayed allocation: data written into holes and past the end of a file waits in
+// per-inode write buffers and gets data blocks only when it is flushed or the file is
+// closed. By then the length of every run is known and each one is placed as a single
+// contiguous reservation. A file removed before that never takes a block at all.
+
+#define DELALLOC_MAX_BLOCKS 4096  // Buffered blocks before a write places all of them
+
+struct pending_block {
+    uint32_t logical;  // File block
+    char *data;        // block_size bytes
+};
+
+char *delalloc_find(const inode *in, uint32_t logical);
+
+char *delalloc_get(filetype *node, uint32_t logical, int *err);
+
+int delalloc_flush_node(filetype *node);
+
+int delalloc_flush_all();
+
+void delalloc_drop(filetype *node, uint32_t logical);
+
+long delalloc_bytes();
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef DIRTY_H
+#define DIRTY_H
+
+#include "../include/superblock.h"
+#include "../include/filetype.h"
+
+#define MAX_DIRTY_INODES 128
+#define EVICT_INTERVAL 10  // Seconds between scans for cold directories
+
+void mark_block_dirty(int block);
+
+void mark_data_bitmap_dirty(int index);
+
+void mark_inode_bitmap_dirty(int index);
+
+void mark_inode_dirty(filetype *node);
+
+void mark_atime_dirty(filetype *node);
+
+void forget_inode_dirty(filetype *node);
+
+void mark_inode_logged(filetype *node);
+
+void mark_inode_freed(int number);
+
+int node_pinned(const filetype *node);
+
+int inode_committed(const filetype *node);
+
+long dirty_state_bytes();
+
+int flush_dirty_state();
+
+void require_checkpoint();
+
+int checkpoint_state();
+
+void close_dirty_state();
+
+#endif
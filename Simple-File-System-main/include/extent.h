@@ -0,0 +1,48 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+
+// A run of consecutive data blocks backing consecutive file blocks.
+// Each inode keeps its runs sorted by file block, without overlaps.
+typedef struct extent {
+    uint32_t logical;  // First file block of the run
+    uint32_t start;    // First data block
+    uint32_t length;   // Number of blocks
+} extent;
+
+typedef struct inode inode;
+
+// Short lists live in the inode record, longer ones in an extent tree. Its leaves hold
+// runs, index nodes above them point at up to extent_index_capacity() children, like
+// single, double and triple indirect blocks. Every node is one data block:
+// magic, entry count, owner inode number, level (le32), then the entries.
+#define INODE_BLOCK_AREA 176            // Bytes of the inode record for inline runs or inline data
+#define EXTENT_RECORD_SIZE 12           // Leaf entry: logical, start, length
+#define INODE_INLINE_EXTENTS (INODE_BLOCK_AREA / EXTENT_RECORD_SIZE)
+#define EXTENT_INDEX_SIZE 8             // Index entry: first file block, child node
+#define EXTENT_BLOCK_HEADER 16
+#define EXTENT_BLOCK_MAGIC 0x58534653u  // "SFSX"
+#define EXTENT_MAX_DEPTH 3
+
+uint32_t extent_leaf_capacity();
+
+uint32_t extent_index_capacity();
+
+uint32_t extent_max_runs();
+
+int extent_tree_depth(uint32_t runs);
+
+int extent_lookup(inode *i, uint32_t logical, uint32_t *block, uint32_t *run);
+
+int extent_map(inode *i, uint32_t logical, uint32_t block);
+
+void extent_truncate(inode *i, uint32_t logical, void (*release)(int block));
+
+int extent_punch(inode *i, uint32_t logical, uint32_t count, void (*release)(int block));
+
+int extent_copy(inode *dst, const inode *src);
+
+void extent_free(inode *i);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef FLUSHER_H
+#define FLUSHER_H
+
+#include "../include/filetype.h"
+
+void fs_lock();
+
+void fs_unlock();
+
+int start_flusher();
+
+void stop_flusher();
+
+int commit_dirty_state();
+
+int commit_node(filetype *node);
+
+#endif
@@ -4,13 +4,29 @@
 #include "../include/inode.h"
 #include "../include/superblock.h"
 #include "../include/filetype.h"
+#include "../include/names.h"
 #include "../include/operations.h"
 #include "../include/utilities.h"
+#include "../include/dirty.h"
+#include "../include/journal.h"
+#include "../include/image.h"
+#include "../include/flusher.h"
+#include "../include/options.h"
+#include "../include/snapshot.h"
+#include "../include/delalloc.h"
+#include "../include/dcache.h"
 
+#ifndef S_IFDIR
 #define S_IFDIR 0x4000
+#endif
+
+#define IMAGE_PATH "sfs.img"
+#define JOURNAL_PATH "journal.bin"
 
 void root_dir_init();
 
+int save_file_structure();
+
 int save_system_state();
 
 void restore_file_system();
@@ -0,0 +1,34 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Name arena: entry names live in 64 KiB chunks and a node refers to its name by a
+// 32-bit offset into them. A name takes the smallest slot of 16, 32, 64 or 128 bytes
+// that holds it, freed slots wait on a free list per size. Chunks never move, so a
+// name returned by name_str stays valid until its slot is released.
+// Reference 0 is the empty name and is never released.
+
+#define NAME_CHUNK_SIZE (64 * 1024)
+#define NAME_MIN_SLOT 16
+#define NAME_SLOT_CLASSES 4
+#define NAME_MAX_LEN 112 // Longest name, without the terminator, the same cap as DIRENT_NAME_LEN on disk
+
+typedef struct name_stats {
+    size_t chunk_bytes;  // Allocated for chunks
+    size_t used_bytes;   // Taken by the slots of live names
+    long names;          // Live names
+} name_stats;
+
+uint32_t name_store(const char *name, size_t len);
+
+const char *name_str(uint32_t ref);
+
+void name_release(uint32_t ref);
+
+name_stats names_get_stats();
+
+void names_close();
+
+#endif
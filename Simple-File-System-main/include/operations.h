@@ -12,14 +12,10 @@
 #include <unistd.h>
 #include "fuse.h"
 #include "fs_init.h"
-// Добавьте определения, если их нет. Подстройте block_size под вашу систему, если он отличается.
-#ifndef block_size
-#define block_size 4096 // Пример: 4KB блок. Убедитесь, что это соответствует вашей SuperBlock.
-#endif
-#define MAX_BLOCKS 16 // Максимальное количество блоков на один inode (у вас уже есть)
-// Максимальный размер файла для inode с 16 прямыми блоками
-// Убедитесь, что int в inode достаточно большой для этого значения
-#define MAX_FILE_SIZE (MAX_BLOCKS * block_size)
+// block_size берётся из заголовка образа (см. superblock.h)
+// Файл описывается экстентами, поэтому его размер ограничен только областью данных
+#define MAX_FILE_SIZE ((unsigned long long)BLOCK_COUNT * block_size)
+#define PREALLOC_MAX_BLOCKS 64 // Предел спекулятивного резерва блоков для дописываемого файла
 
 # define UTIME_NOW	((1l << 30) - 1l)
 # define UTIME_OMIT	((1l << 30) - 2l)
@@ -52,6 +48,16 @@ void sfs_destroy(void *private_data);
 
 int sfs_truncate(const char *path, off_t size);
 
+void *sfs_init(struct fuse_conn_info *conn);
+
+int sfs_flush(const char *path, struct fuse_file_info *fi);
+
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+
+int sfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi);
+
+int sfs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi);
+
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-variable"
@@ -0,0 +1,31 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+struct fuse_args;
+
+#define DEFAULT_COMMIT_INTERVAL 5          // Seconds between background commits
+#define DEFAULT_DIRTY_LIMIT (256 * 1024)   // Dirty bytes that trigger an early commit
+#define DEFAULT_EVICT_AGE 300              // Seconds before an unused directory may be dropped
+
+// a_time update policy for read, open and readdir
+#define ATIME_STRICT   0  // Every access is written like any other metadata change
+#define ATIME_RELATIME 1  // Only when a_time is older than m_time/c_time or a day old
+#define ATIME_NOATIME  2  // Never updated
+#define ATIME_LAZY     3  // Kept in memory until the next real commit or unmount
+
+#define RELATIME_INTERVAL (24 * 60 * 60)  // relatime still refreshes a_time once a day
+
+typedef struct mount_options {
+    int writeback;        // Handlers only mark state dirty, the flusher thread commits it
+    int commit_interval;  // -o commit_interval=N, seconds
+    long dirty_limit;     // -o dirty_limit=N, bytes
+    int atime;            // -o strictatime|relatime|noatime|lazyatime
+    int evict_age;        // -o evict_age=N, seconds, 0 keeps everything loaded
+    int dcache_size;      // -o dcache_size=N, cached paths, 0 turns the path cache off
+} mount_options;
+
+extern mount_options options;
+
+int parse_mount_options(struct fuse_args *args);
+
+#endif
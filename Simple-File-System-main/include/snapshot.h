@@ -0,0 +1,23 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "../include/filetype.h"
+
+#define SNAPSHOT_DIR_NAME ".snapshots"
+
+// Read-only snapshots are browsed under /.snapshots/<name>.
+// mkdir /.snapshots/<name> freezes the current tree, rmdir drops the snapshot.
+
+filetype *snapshot_directory();
+
+int is_snapshot_path(const char *path);
+
+int load_snapshots(filetype *dir);
+
+int snapshot_create(const char *name);
+
+int snapshot_delete(const char *name);
+
+void close_snapshots();
+
+#endif
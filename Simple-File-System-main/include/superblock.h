@@ -2,19 +2,62 @@
 #define SUPERBLOCK_H
 
 #include <string.h>
+#include <stdint.h>
+#include "../include/bitmap.h"
+#include "../include/group.h"
 
-#define block_size 1024
+// Geometry used by mkfs.sfs when no option overrides it
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_BLOCK_COUNT 100
+#define DEFAULT_INODE_COUNT 105
 
+#define RESERVE_SEARCH_RUNS 64    // Free runs reserve_blocks looks at before settling
+
+// The geometry is read from the image header at open time
+#define block_size ((int)s_block.data_block_size)
+#define BLOCK_COUNT ((int)s_block.block_count)   // Number of data blocks
+#define INODE_COUNT ((int)s_block.inode_count)   // Inode numbers, including the reserved 0 and 1
+
+// Data blocks point into the memory-mapped image, the bitmaps into the
+// working copy of the superblock slot (see image.h)
 typedef struct superblock {
-    char data_blocks[block_size * 100];  // Total number of data blocks
-    char data_bitmap[105];               // Array of available data block numbers
-    char inode_bitmap[105];              // Array of available inode numbers
+    char *data_blocks;    // Data blocks, block_size bytes each
+    uint64_t *data_bitmap;  // Bit per data block, set when allocated (see bitmap.h)
+    uint64_t *inode_bitmap; // Bit per inode number, set when allocated
+    unsigned char *refcounts; // Owners of each data block: the live tree and every snapshot
+    uint32_t data_block_size;
+    uint32_t block_count;
+    uint32_t inode_count;
 } superblock;
 
+// Chosen by mkfs.sfs and stored in the image header
+typedef struct image_geometry {
+    uint32_t data_block_size;
+    uint32_t block_count;
+    uint32_t inode_count;
+    uint32_t snapshot_slots;
+} image_geometry;
+
 extern superblock s_block;
 
 void superblock_init();
 
 int find_free_db();
 
+int find_free_db_near(int goal);
+
+int reserve_blocks(int goal, int want, int *start);
+
+void unreserve_blocks(int start, int count);
+
+int claim_reserved_block(int block);
+
+long free_block_count();
+
+void block_ref(int block);
+
+int block_unref(int block);
+
+int block_shared(int block);
+
 #endif 
\ No newline at end of file
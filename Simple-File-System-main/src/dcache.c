@@ -0,0 +1,208 @@
+#include "../include/fs_init.h"
+#include "../include/dcache.h"
+
+struct dentry {
+    char *path;                 // Without a trailing slash
+    size_t len;
+    uint32_t hash;
+    filetype *node;             // NULL: the path does not exist
+    dentry *hash_next;          // Next entry in the same bucket
+    dentry *node_next;          // Next path cached for the same node
+    dentry *lru_prev;
+    dentry *lru_next;
+};
+
+static dentry **buckets = NULL;
+static uint32_t bucket_mask = 0;
+static int num_entries = 0;
+static dentry lru = { .lru_prev = &lru, .lru_next = &lru };  // Most recently used first
+static dcache_stats stats;
+
+// FNV-1a
+static uint32_t path_hash(const char *path, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int dcache_open() {
+    if (buckets != NULL) {
+        return 0;
+    }
+    if (options.dcache_size <= 0) {
+        return -1;
+    }
+    uint32_t size = 16;
+    while (size < (uint32_t)options.dcache_size) {
+        size *= 2;
+    }
+    buckets = calloc(size, sizeof(dentry *));
+    if (buckets == NULL) {
+        perror("Failed to allocate path cache");
+        return -1;
+    }
+    bucket_mask = size - 1;
+    return 0;
+}
+
+static dentry *find_entry(const char *path, size_t len, uint32_t hash) {
+    for (dentry *d = buckets[hash & bucket_mask]; d != NULL; d = d->hash_next) {
+        if (d->hash == hash && d->len == len && memcmp(d->path, path, len) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(dentry *d) {
+    d->lru_prev->lru_next = d->lru_next;
+    d->lru_next->lru_prev = d->lru_prev;
+}
+
+static void lru_push(dentry *d) {
+    d->lru_prev = &lru;
+    d->lru_next = lru.lru_next;
+    lru.lru_next->lru_prev = d;
+    lru.lru_next = d;
+}
+
+static void remove_entry(dentry *d) {
+    dentry **link = &buckets[d->hash & bucket_mask];
+    while (*link != d) {
+        link = &(*link)->hash_next;
+    }
+    *link = d->hash_next;
+    if (d->node != NULL) {
+        link = &d->node->dentries;
+        while (*link != d) {
+            link = &(*link)->node_next;
+        }
+        *link = d->node_next;
+    }
+    lru_unlink(d);
+    free(d->path);
+    free(d);
+    num_entries--;
+}
+
+// Returns 1 when the path is cached, *node is then NULL for a path that does not exist
+int dcache_lookup(const char *path, size_t len, filetype **node) {
+    if (buckets == NULL) {
+        stats.misses++;
+        return 0;
+    }
+    dentry *d = find_entry(path, len, path_hash(path, len));
+    if (d == NULL) {
+        stats.misses++;
+        return 0;
+    }
+    lru_unlink(d);
+    lru_push(d);
+    if (d->node != NULL) {
+        stats.hits++;
+    } else {
+        stats.negative_hits++;
+    }
+    *node = d->node;
+    return 1;
+}
+
+// Remembers the result of a walk, node NULL for a path that does not exist
+void dcache_insert(const char *path, size_t len, filetype *node) {
+    if (dcache_open() != 0) {
+        return;
+    }
+    uint32_t hash = path_hash(path, len);
+    dentry *d = find_entry(path, len, hash);
+    if (d != NULL) {
+        remove_entry(d);
+    }
+    if (num_entries >= options.dcache_size) {
+        remove_entry(lru.lru_prev);
+        stats.evictions++;
+    }
+    d = malloc(sizeof(dentry));
+    char *copy = malloc(len + 1);
+    if (d == NULL || copy == NULL) {
+        free(d);
+        free(copy);
+        return; // Only a cache, the next lookup walks again
+    }
+    memcpy(copy, path, len);
+    copy[len] = '\0';
+    d->path = copy;
+    d->len = len;
+    d->hash = hash;
+    d->node = node;
+    d->hash_next = buckets[hash & bucket_mask];
+    buckets[hash & bucket_mask] = d;
+    if (node != NULL) {
+        d->node_next = node->dentries;
+        node->dentries = d;
+    }
+    lru_push(d);
+    num_entries++;
+}
+
+// Drops one path, after create, mkdir or unlink made it exist or disappear
+void dcache_invalidate(const char *path) {
+    if (buckets == NULL) {
+        return;
+    }
+    size_t len = strlen(path);
+    dentry *d = find_entry(path, len, path_hash(path, len));
+    if (d != NULL) {
+        remove_entry(d);
+        stats.invalidations++;
+    }
+}
+
+// Drops a path and everything below it, after rmdir or rename
+void dcache_invalidate_prefix(const char *path) {
+    if (buckets == NULL) {
+        return;
+    }
+    size_t len = strlen(path);
+    if (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    dentry *next;
+    for (dentry *d = lru.lru_next; d != &lru; d = next) {
+        next = d->lru_next;
+        if (d->len >= len && memcmp(d->path, path, len) == 0 && (d->len == len || d->path[len] == '/')) {
+            remove_entry(d);
+            stats.invalidations++;
+        }
+    }
+}
+
+// The node is being freed, none of its paths may find it again
+void dcache_forget_node(filetype *node) {
+    while (node->dentries != NULL) {
+        remove_entry(node->dentries);
+    }
+}
+
+void dcache_clear() {
+    while (lru.lru_next != &lru) {
+        remove_entry(lru.lru_next);
+    }
+}
+
+dcache_stats dcache_get_stats() {
+    return stats;
+}
+
+void dcache_close() {
+    if (buckets == NULL) {
+        return;
+    }
+    printf("SFS: path cache %ld hits, %ld negative hits, %ld misses, %ld evictions, %ld invalidations\n",
+           stats.hits, stats.negative_hits, stats.misses, stats.evictions, stats.invalidations);
+    dcache_clear();
+    free(buckets);
+    buckets = NULL;
+    bucket_mask = 0;
+}
@@ -0,0 +1,192 @@
+#include "../include/fs_init.h"
+#include "../include/delalloc.h"
+#include <errno.h>
+
+static filetype **pending_nodes = NULL;  // Nodes with buffered blocks, in no particular order
+static int num_pending_nodes = 0;
+static int pending_nodes_capacity = 0;
+static long buffered_blocks = 0;         // Blocks promised to buffers, kept free for them
+
+// Index of the first buffered block at or after logical
+static int find_pending(const inode *in, uint32_t logical) {
+    int lo = 0, hi = in->num_pending;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (in->pending[mid].logical < logical) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int track_node(filetype *node) {
+    if (num_pending_nodes == pending_nodes_capacity) {
+        int capacity = pending_nodes_capacity == 0 ? 16 : pending_nodes_capacity * 2;
+        filetype **list = realloc(pending_nodes, capacity * sizeof(filetype *));
+        if (list == NULL) {
+            perror("Failed to grow delayed allocation list");
+            return -ENOMEM;
+        }
+        pending_nodes = list;
+        pending_nodes_capacity = capacity;
+    }
+    pending_nodes[num_pending_nodes++] = node;
+    return 0;
+}
+
+static void untrack_node(filetype *node) {
+    for (int i = 0; i < num_pending_nodes; i++) {
+        if (pending_nodes[i] == node) {
+            pending_nodes[i] = pending_nodes[--num_pending_nodes];
+            return;
+        }
+    }
+}
+
+// Removes the first count buffered blocks of the file, their data already freed
+static void remove_pending(filetype *node, int first, int count) {
+    inode *in = node->inum;
+    memmove(&in->pending[first], &in->pending[first + count], (in->num_pending - first - count) * sizeof(pending_block));
+    in->num_pending -= count;
+    buffered_blocks -= count;
+    if (in->num_pending == 0) {
+        free(in->pending);
+        in->pending = NULL;
+        in->pending_capacity = 0;
+        untrack_node(node);
+    }
+}
+
+char *delalloc_find(const inode *in, uint32_t logical) {
+    int k = find_pending(in, logical);
+    return k < in->num_pending && in->pending[k].logical == logical ? in->pending[k].data : NULL;
+}
+
+// Buffer of a file block, a zeroed one is added when the block has none yet. Fails
+// with -ENOSPC once the buffers would need more blocks than are free.
+char *delalloc_get(filetype *node, uint32_t logical, int *err) {
+    inode *in = node->inum;
+    int k = find_pending(in, logical);
+    if (k < in->num_pending && in->pending[k].logical == logical) {
+        return in->pending[k].data;
+    }
+    if (buffered_blocks + 1 > free_block_count()) {
+        *err = -ENOSPC;
+        return NULL;
+    }
+    if (in->num_pending == in->pending_capacity) {
+        int capacity = in->pending_capacity == 0 ? 8 : in->pending_capacity * 2;
+        pending_block *list = realloc(in->pending, capacity * sizeof(pending_block));
+        if (list == NULL) {
+            perror("Failed to grow write buffer");
+            *err = -ENOMEM;
+            return NULL;
+        }
+        in->pending = list;
+        in->pending_capacity = capacity;
+    }
+    char *data = calloc(1, block_size);
+    if (data == NULL || (in->num_pending == 0 && track_node(node) != 0)) {
+        free(data);
+        *err = -ENOMEM;
+        return NULL;
+    }
+    memmove(&in->pending[k + 1], &in->pending[k], (in->num_pending - k) * sizeof(pending_block));
+    in->pending[k].logical = logical;
+    in->pending[k].data = data;
+    in->num_pending++;
+    buffered_blocks++;
+    return data;
+}
+
+// Gives every buffered block of the file its data block. Each run of consecutive file
+// blocks is reserved in one piece right after the data block of the file block before
+// it, or at the start of the inode's group. Blocks that cannot be placed stay buffered.
+int delalloc_flush_node(filetype *node) {
+    inode *in = node->inum;
+    if (in == NULL || in->num_pending == 0) {
+        return 0;
+    }
+    // The whole run is known now, the speculative reservation is not needed
+    unreserve_blocks(in->prealloc_start, in->prealloc_len);
+    in->prealloc_len = 0;
+
+    int placed = 0;
+    int ret = 0;
+    while (ret == 0 && placed < in->num_pending) {
+        pending_block *p = &in->pending[placed];
+        int len = 1;
+        while (placed + len < in->num_pending && p[len].logical == p[0].logical + (uint32_t)len) {
+            len++;
+        }
+        int goal = group_goal_block(in->number);
+        uint32_t prev, run;
+        if (p[0].logical > 0 && extent_lookup(in, p[0].logical - 1, &prev, &run)) {
+            goal = (int)prev + 1;
+        }
+        int start;
+        int got = reserve_blocks(goal, len, &start);
+        int count = got > 0 ? got : 1;
+        int k = 0;
+        for (; k < count; k++) {
+            int block = got > 0 ? claim_reserved_block(start + k) : find_free_db_near(goal);
+            if (block == -1) {
+                ret = -ENOSPC;
+                break;
+            }
+            int err = extent_map(in, p[k].logical, block);
+            if (err != 0) {
+                block_unref(block);
+                ret = err;
+                break;
+            }
+            memcpy(s_block.data_blocks + (size_t)block * block_size, p[k].data, block_size);
+            free(p[k].data);
+            mark_data_bitmap_dirty(block);
+            mark_block_dirty(block);
+        }
+        if (got > k) {
+            unreserve_blocks(start + k, got - k);
+        }
+        placed += k;
+    }
+    if (placed > 0) {
+        remove_pending(node, 0, placed);
+        mark_inode_dirty(node);
+    }
+    return ret;
+}
+
+// Returns the first error, the nodes after it are still flushed
+int delalloc_flush_all() {
+    int ret = 0;
+    // Flushing a node may drop it from the list, which moves the last one into its place
+    for (int i = num_pending_nodes - 1; i >= 0; i--) {
+        int err = i < num_pending_nodes ? delalloc_flush_node(pending_nodes[i]) : 0;
+        if (err != 0 && ret == 0) {
+            ret = err;
+        }
+    }
+    return ret;
+}
+
+// Throws away the buffered blocks from file block logical on, for truncate and unlink
+void delalloc_drop(filetype *node, uint32_t logical) {
+    inode *in = node->inum;
+    if (in == NULL || in->num_pending == 0) {
+        return;
+    }
+    int k = find_pending(in, logical);
+    for (int i = k; i < in->num_pending; i++) {
+        free(in->pending[i].data);
+    }
+    if (k < in->num_pending) {
+        remove_pending(node, k, in->num_pending - k);
+    }
+}
+
+long delalloc_bytes() {
+    return buffered_blocks * block_size;
+}
@@ -0,0 +1,353 @@
+#include "../include/fs_init.h"
+
+// Handlers modify the mapped image directly. Only the regions recorded here
+// are pushed to disk with msync, everything else is left to the page cache.
+static char *dirty_blocks = NULL;  // One flag per data block, sized from the image geometry
+static int *dirty_list = NULL;     // Numbers of the flagged blocks, a flush never scans the whole map
+static int num_dirty_blocks = 0;
+static int dirty_capacity = 0;
+static int superblock_dirty = 0;   // Bitmaps or reference counts changed since the last commit
+
+static filetype *dirty_inodes[MAX_DIRTY_INODES];
+static int num_dirty_inodes = 0;
+static filetype *lazy_atimes[MAX_DIRTY_INODES];
+static int num_lazy_atimes = 0;
+static unsigned flush_generation = 1;
+static int freed_inodes[MAX_DIRTY_INODES];
+static int num_freed_inodes = 0;
+static unsigned journal_epoch = 1; // Incremented whenever the journal is reset
+static int checkpoint_needed = 0;  // Too many dirty inodes, rewrite the whole table instead
+static int table_lo = -1, table_hi = -1; // Inode numbers whose records changed
+static long dirty_bytes = 0;      // Estimate of what the next flush has to write
+
+static void extend_range(int *lo, int *hi, int index) {
+    if (*lo == -1 || index < *lo) *lo = index;
+    if (*hi == -1 || index > *hi) *hi = index;
+}
+
+void mark_block_dirty(int block) {
+    if (block < 0 || block >= BLOCK_COUNT) {
+        return;
+    }
+    if (dirty_blocks == NULL && (dirty_blocks = calloc(BLOCK_COUNT, 1)) == NULL) {
+        perror("Failed to allocate dirty block map");
+        image_sync(s_block.data_blocks + (size_t)block * block_size, block_size); // Write through instead
+        return;
+    }
+    if (dirty_blocks[block]) {
+        return;
+    }
+    if (num_dirty_blocks == dirty_capacity) {
+        int capacity = dirty_capacity == 0 ? 64 : dirty_capacity * 2;
+        int *list = realloc(dirty_list, capacity * sizeof(int));
+        if (list == NULL) {
+            perror("Failed to grow dirty block list");
+            image_sync(s_block.data_blocks + (size_t)block * block_size, block_size);
+            return;
+        }
+        dirty_list = list;
+        dirty_capacity = capacity;
+    }
+    dirty_blocks[block] = 1;
+    dirty_list[num_dirty_blocks++] = block;
+    dirty_bytes += block_size;
+}
+
+void mark_data_bitmap_dirty(int index) {
+    if (index >= 0 && index < BLOCK_COUNT) {
+        dirty_bytes++;
+        superblock_dirty = 1;
+    }
+}
+
+void mark_inode_bitmap_dirty(int index) {
+    if (index >= 0 && index < INODE_COUNT) {
+        dirty_bytes++;
+        superblock_dirty = 1;
+    }
+}
+
+void mark_inode_dirty(filetype *node) {
+    if (node == NULL || node->inum == NULL || node->frozen) {
+        return; // Snapshot nodes are never written back
+    }
+    if (checkpoint_needed) {
+        return; // The whole tree will be rewritten anyway
+    }
+    if (node->dirty_gen == flush_generation) {
+        return; // Already queued in this generation
+    }
+    if (num_dirty_inodes == MAX_DIRTY_INODES) {
+        checkpoint_needed = 1; // Too many scattered updates, fall back to a full rewrite
+        return;
+    }
+    node->dirty_gen = flush_generation;
+    dirty_inodes[num_dirty_inodes++] = node;
+    dirty_bytes += INODE_RECORD_SIZE;
+}
+
+// A node is durable once the flush of the generation it was dirtied in has completed
+// and none of its blocks is still buffered
+int inode_committed(const filetype *node) {
+    return !checkpoint_needed && !journal_pending() && node->dirty_gen < flush_generation &&
+           (node->inum == NULL || node->inum->num_pending == 0);
+}
+
+long dirty_state_bytes() {
+    return dirty_bytes + delalloc_bytes();
+}
+
+// Lazy atime: the new a_time alone is not worth a write. It rides along
+// with the next flush that has real work to do, or is written at unmount.
+void mark_atime_dirty(filetype *node) {
+    if (node == NULL || node->inum == NULL || node->atime_dirty || node->dirty_gen == flush_generation) {
+        return;
+    }
+    if (num_lazy_atimes == MAX_DIRTY_INODES) {
+        return; // The in-memory a_time is still correct, it only misses this commit
+    }
+    node->atime_dirty = 1;
+    lazy_atimes[num_lazy_atimes++] = node;
+}
+
+static void promote_lazy_atimes() {
+    for (int i = 0; i < num_lazy_atimes; i++) {
+        lazy_atimes[i]->atime_dirty = 0;
+        mark_inode_dirty(lazy_atimes[i]);
+    }
+    num_lazy_atimes = 0;
+}
+
+// Must be called before a node is freed, the dirty lists would keep a dangling pointer
+void forget_inode_dirty(filetype *node) {
+    delalloc_drop(node, 0); // Buffered data of a deleted file never gets blocks
+    for (int i = 0; node->atime_dirty && i < num_lazy_atimes; i++) {
+        if (lazy_atimes[i] == node) {
+            lazy_atimes[i] = lazy_atimes[--num_lazy_atimes];
+            node->atime_dirty = 0;
+            break;
+        }
+    }
+    for (int i = 0; i < num_dirty_inodes; i++) {
+        if (dirty_inodes[i] == node) {
+            dirty_inodes[i] = dirty_inodes[--num_dirty_inodes];
+            return;
+        }
+    }
+}
+
+// The node is named by a journal record (create, truncate). Replaying that record
+// would roll its inode back, so until the next journal reset every flush also
+// journals the current inode, and the newest record wins during replay.
+void mark_inode_logged(filetype *node) {
+    if (node == NULL || node->inum == NULL) {
+        return;
+    }
+    node->journal_epoch = journal_epoch;
+    mark_inode_dirty(node);
+}
+
+// Nodes that must stay in memory: dirty, waiting for a lazy atime, or still
+// journaled on every flush. Evicting them would lose state the image lacks.
+int node_pinned(const filetype *node) {
+    return node->atime_dirty || node->dirty_gen == flush_generation ||
+           (node->inum != NULL && node->inum->num_pending > 0) ||
+           (node->journal_epoch == journal_epoch && journal_size() > 0);
+}
+
+// Called after a successful flush, when the image describes every clean node
+static void evict_cold_nodes() {
+    static time_t last_eviction = 0;
+    time_t now = time(NULL);
+    if (options.evict_age <= 0 || root == NULL || now - last_eviction < EVICT_INTERVAL) {
+        return;
+    }
+    last_eviction = now;
+    int evicted = evict_cold_subtrees(root, now - options.evict_age);
+    if (evicted > 0) {
+        printf("SFS: evicted %d cold directories\n", evicted);
+    }
+}
+
+// The records of a removed inode are cleared at the next flush
+void mark_inode_freed(int number) {
+    if (number < 0 || number >= INODE_COUNT) {
+        return;
+    }
+    if (num_freed_inodes == MAX_DIRTY_INODES) {
+        checkpoint_needed = 1;
+        return;
+    }
+    freed_inodes[num_freed_inodes++] = number;
+    dirty_bytes += INODE_RECORD_SIZE + DIRENT_RECORD_SIZE;
+}
+
+// A node whose path does not fit a record cannot be journaled, the flush
+// then falls back to a checkpoint, which needs no records
+static int journal_logged_inodes() {
+    char path[JOURNAL_PATH_LEN];
+    for (int i = 0; i < num_dirty_inodes; i++) {
+        filetype *node = dirty_inodes[i];
+        if (node->journal_epoch == journal_epoch) {
+            if (node_full_path(node, path, sizeof(path)) != 0) {
+                checkpoint_needed = 1;
+                return 0;
+            }
+            if (journal_log_inode(JR_INODE, path, node->inum) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Inode and dirent records sit at fixed offsets, each dirty node is patched in place.
+// Freed records are cleared first: a number released and handed out again within
+// one flush window belongs to the new node, whose store below must win.
+static int flush_inodes() {
+    for (int i = 0; i < num_freed_inodes; i++) {
+        image_clear_node(freed_inodes[i]);
+        extend_range(&table_lo, &table_hi, freed_inodes[i]);
+    }
+    for (int i = 0; i < num_dirty_inodes; i++) {
+        filetype *node = dirty_inodes[i];
+        int extent_block = node->inum->extent_block;
+        if (image_store_node(node) != 0) {
+            return -1;
+        }
+        if (node->inum->extent_block != extent_block) {
+            superblock_dirty = 1; // Extent tree nodes were allocated or freed
+        }
+        extend_range(&table_lo, &table_hi, node->inum->number);
+    }
+    if (table_lo == -1) {
+        return 0;
+    }
+
+    size_t count = table_hi - table_lo + 1;
+    if (image_sync(image_inode(table_lo), count * INODE_RECORD_SIZE) != 0 ||
+        image_sync(image_dirent(table_lo), count * DIRENT_RECORD_SIZE) != 0) {
+        return -1;
+    }
+    table_lo = table_hi = -1;
+    return 0;
+}
+
+static int compare_blocks(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static int flush_superblock() {
+    // Adjacent dirty blocks are coalesced into a single msync
+    qsort(dirty_list, num_dirty_blocks, sizeof(int), compare_blocks);
+    int i = 0;
+    while (i < num_dirty_blocks) {
+        int run_start = i;
+        while (i + 1 < num_dirty_blocks && dirty_list[i + 1] == dirty_list[i] + 1) {
+            i++;
+        }
+        i++;
+        if (image_sync(s_block.data_blocks + (size_t)dirty_list[run_start] * block_size,
+                       (size_t)(i - run_start) * block_size) != 0) {
+            return -1;
+        }
+    }
+
+    // The changed bitmap and refcount chunks go out together in one superblock slot commit
+    if (superblock_dirty && image_commit_superblock() != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// A change already made in memory whose journal record could not be written.
+// The next flush rewrites the whole table instead of patching records in place.
+void require_checkpoint() {
+    checkpoint_needed = 1;
+}
+
+// Rewrites the whole inode table and drops the journal records it now contains
+int checkpoint_state() {
+    // The rewrite may allocate extent blocks, so the bitmaps are committed with it
+    if (save_system_state() != 0) {
+        return -1;
+    }
+    if (journal_reset() != 0) {
+        return -1;
+    }
+    journal_epoch++;
+    checkpoint_needed = 0;
+    return 0;
+}
+
+// Returns -ENOSPC (or the extent error) when buffered blocks could not be placed.
+// Everything else is still committed, the unplaced blocks stay buffered for the next flush.
+int flush_dirty_state() {
+    int ret = 0;
+
+    // Buffered writes get their blocks first, so this commit carries them
+    int unplaced = delalloc_flush_all();
+
+    if (num_lazy_atimes > 0 && (num_dirty_inodes > 0 || dirty_bytes > 0 || journal_pending() || checkpoint_needed)) {
+        promote_lazy_atimes();
+    }
+
+    // Write-ahead order: journal records reach the disk before the in-place updates they describe
+    if (!checkpoint_needed && journal_logged_inodes() != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && journal_sync() != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && !checkpoint_needed && flush_inodes() != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && flush_superblock() != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && checkpoint_needed) {
+        ret = checkpoint_state();
+    } else if (ret == 0 && journal_size() >= JOURNAL_CHECKPOINT_BYTES) {
+        // Everything the journal describes is already in place
+        if (journal_reset() != 0) {
+            ret = -1;
+        } else {
+            journal_epoch++;
+        }
+    }
+    if (ret != 0) {
+        return ret; // Keep everything dirty so the next flush retries
+    }
+
+    for (int i = 0; i < num_dirty_blocks; i++) {
+        dirty_blocks[dirty_list[i]] = 0;
+    }
+    num_dirty_blocks = 0;
+    superblock_dirty = 0;
+    num_dirty_inodes = 0;
+    num_freed_inodes = 0;
+    dirty_bytes = 0;
+    flush_generation++;
+
+    evict_cold_nodes();
+
+    return unplaced;
+}
+
+void close_dirty_state() {
+    if (num_lazy_atimes > 0) {
+        promote_lazy_atimes();
+        flush_dirty_state();
+    }
+    if ((checkpoint_needed || journal_size() > 0) && flush_dirty_state() == 0) {
+        journal_reset(); // Everything is in place, the next mount has nothing to replay
+    }
+    journal_close();
+    image_close();
+    free(dirty_blocks);
+    free(dirty_list);
+    dirty_blocks = NULL;
+    dirty_list = NULL;
+    num_dirty_blocks = dirty_capacity = 0;
+}
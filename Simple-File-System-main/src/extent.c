@@ -0,0 +1,263 @@
+#include "../include/inode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+uint32_t extent_leaf_capacity() {
+    return (uint32_t)(block_size - EXTENT_BLOCK_HEADER) / EXTENT_RECORD_SIZE;
+}
+
+uint32_t extent_index_capacity() {
+    return (uint32_t)(block_size - EXTENT_BLOCK_HEADER) / EXTENT_INDEX_SIZE;
+}
+
+// Runs a tree of EXTENT_MAX_DEPTH levels can hold. A file never has more runs than
+// the image has blocks, so that bounds the mapping as well.
+uint32_t extent_max_runs() {
+    uint64_t runs = extent_leaf_capacity();
+    for (int level = 1; level < EXTENT_MAX_DEPTH; level++) {
+        runs *= extent_index_capacity();
+    }
+    return runs < (uint64_t)BLOCK_COUNT ? (uint32_t)runs : (uint32_t)BLOCK_COUNT;
+}
+
+// Levels needed for a list of runs, 0 when it fits into the record
+int extent_tree_depth(uint32_t runs) {
+    if (runs <= INODE_INLINE_EXTENTS) {
+        return 0;
+    }
+    int depth = 1;
+    uint64_t capacity = extent_leaf_capacity();
+    while (runs > capacity) {
+        capacity *= extent_index_capacity();
+        depth++;
+    }
+    return depth;
+}
+
+// Index of the first run that ends after the file block, num_extents if none does
+static int find_extent(const inode *i, uint32_t logical) {
+    int lo = 0, hi = i->num_extents;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const extent *e = &i->extents[mid];
+        if (e->logical + e->length <= logical) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Returns 1 for a mapped file block, with its data block and the number of blocks
+// left in the run. Returns 0 for a hole, with the number of unmapped blocks before
+// the next run (UINT32_MAX past the last one).
+int extent_lookup(inode *i, uint32_t logical, uint32_t *block, uint32_t *run) {
+    int k = i->extent_hint;
+    // Sequential access stays in the last run or moves to the next one
+    if (k >= i->num_extents || i->extents[k].logical > logical) {
+        k = find_extent(i, logical);
+    } else if (i->extents[k].logical + i->extents[k].length <= logical) {
+        k++;
+        if (k < i->num_extents && i->extents[k].logical + i->extents[k].length <= logical) {
+            k = find_extent(i, logical);
+        }
+    }
+    i->extent_hint = k;
+    if (k == i->num_extents) {
+        *run = UINT32_MAX;
+        return 0;
+    }
+    const extent *e = &i->extents[k];
+    if (logical < e->logical) {
+        *run = e->logical - logical;
+        return 0;
+    }
+    *block = e->start + (logical - e->logical);
+    *run = e->length - (logical - e->logical);
+    return 1;
+}
+
+static int reserve_extents(inode *i, int count) {
+    if (count <= i->extent_capacity) {
+        return 0;
+    }
+    int capacity = i->extent_capacity == 0 ? INODE_INLINE_EXTENTS : i->extent_capacity;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    extent *list = realloc(i->extents, capacity * sizeof(extent));
+    if (list == NULL) {
+        perror("Failed to grow extent list");
+        return -ENOMEM;
+    }
+    i->extents = list;
+    i->extent_capacity = capacity;
+    return 0;
+}
+
+static void insert_extent(inode *i, int k, extent e) {
+    memmove(&i->extents[k + 1], &i->extents[k], (i->num_extents - k) * sizeof(extent));
+    i->extents[k] = e;
+    i->num_extents++;
+}
+
+static void remove_extent(inode *i, int k) {
+    memmove(&i->extents[k], &i->extents[k + 1], (i->num_extents - k - 1) * sizeof(extent));
+    i->num_extents--;
+}
+
+// Points one file block at a data block. An earlier mapping of that file block is
+// replaced, its data block is left to the caller. Runs that become contiguous are merged.
+int extent_map(inode *i, uint32_t logical, uint32_t block) {
+    // Splitting a run in the middle adds two records
+    if ((uint32_t)i->num_extents + 2 > extent_max_runs()) {
+        return -EFBIG;
+    }
+    if (reserve_extents(i, i->num_extents + 2) != 0) {
+        return -ENOMEM;
+    }
+
+    int k = find_extent(i, logical);
+    if (k < i->num_extents && i->extents[k].logical <= logical) {
+        extent *e = &i->extents[k];
+        uint32_t before = logical - e->logical;
+        if (e->start + before == block) {
+            return 0;
+        }
+        extent tail = { logical + 1, e->start + before + 1, e->length - before - 1 };
+        if (before == 0) {
+            remove_extent(i, k);
+        } else {
+            e->length = before;
+            k++;
+        }
+        if (tail.length > 0) {
+            insert_extent(i, k, tail);
+        }
+        i->blocks--;
+    }
+
+    extent run = { logical, block, 1 };
+    insert_extent(i, k, run);
+    i->blocks++;
+
+    if (k > 0) {
+        extent *prev = &i->extents[k - 1];
+        if (prev->logical + prev->length == logical && prev->start + prev->length == block) {
+            prev->length++;
+            remove_extent(i, k);
+            k--;
+        }
+    }
+    if (k + 1 < i->num_extents) {
+        extent *e = &i->extents[k];
+        extent *next = &i->extents[k + 1];
+        if (e->logical + e->length == next->logical && e->start + e->length == next->start) {
+            e->length += next->length;
+            remove_extent(i, k + 1);
+        }
+    }
+    i->extents_dirty = 1;
+    return 0;
+}
+
+// Unmaps every file block from logical on and hands each data block to release
+void extent_truncate(inode *i, uint32_t logical, void (*release)(int block)) {
+    int k = find_extent(i, logical);
+    if (k == i->num_extents) {
+        return;
+    }
+    int keep = k;
+    extent *e = &i->extents[k];
+    if (e->logical < logical) {
+        uint32_t kept = logical - e->logical;
+        for (uint32_t b = kept; b < e->length; b++) {
+            release((int)(e->start + b));
+        }
+        i->blocks -= (int)(e->length - kept);
+        e->length = kept;
+        k++;
+        keep++;
+    }
+    for (; k < i->num_extents; k++) {
+        e = &i->extents[k];
+        for (uint32_t b = 0; b < e->length; b++) {
+            release((int)(e->start + b));
+        }
+        i->blocks -= (int)e->length;
+    }
+    i->num_extents = keep;
+    i->extents_dirty = 1;
+}
+
+// Unmaps file blocks [logical, logical + count) and hands each data block to release.
+// Punching the middle of a run splits it, which fails when the list is full.
+int extent_punch(inode *i, uint32_t logical, uint32_t count, void (*release)(int block)) {
+    uint64_t end = (uint64_t)logical + count;
+    int k = find_extent(i, logical);
+    if (k < i->num_extents && i->extents[k].logical < logical &&
+        (uint64_t)i->extents[k].logical + i->extents[k].length > end) {
+        if ((uint32_t)i->num_extents + 1 > extent_max_runs()) {
+            return -EFBIG;
+        }
+        if (reserve_extents(i, i->num_extents + 1) != 0) {
+            return -ENOMEM;
+        }
+        extent *e = &i->extents[k];
+        uint32_t from = logical - e->logical;
+        extent tail = { (uint32_t)end, e->start + from + count, e->length - from - count };
+        for (uint32_t b = from; b < from + count; b++) {
+            release((int)(e->start + b));
+        }
+        i->blocks -= (int)count;
+        e->length = from;
+        insert_extent(i, k + 1, tail);
+        i->extents_dirty = 1;
+        return 0;
+    }
+    while (k < i->num_extents && i->extents[k].logical < end) {
+        extent *e = &i->extents[k];
+        uint32_t from = logical > e->logical ? logical - e->logical : 0;
+        uint32_t to = (uint64_t)e->logical + e->length > end ? (uint32_t)(end - e->logical) : e->length;
+        for (uint32_t b = from; b < to; b++) {
+            release((int)(e->start + b));
+        }
+        i->blocks -= (int)(to - from);
+        i->extents_dirty = 1;
+        if (from == 0 && to == e->length) {
+            remove_extent(i, k);
+            continue;
+        }
+        if (from == 0) {
+            e->logical += to;
+            e->start += to;
+            e->length -= to;
+        } else {
+            e->length = from;
+        }
+        k++;
+    }
+    return 0;
+}
+
+// Gives dst its own copy of the runs of src
+int extent_copy(inode *dst, const inode *src) {
+    dst->num_extents = 0;
+    if (reserve_extents(dst, src->num_extents) != 0) {
+        return -ENOMEM;
+    }
+    if (src->num_extents > 0) {
+        memcpy(dst->extents, src->extents, src->num_extents * sizeof(extent));
+    }
+    dst->num_extents = src->num_extents;
+    return 0;
+}
+
+void extent_free(inode *i) {
+    free(i->extents);
+    i->extents = NULL;
+    i->num_extents = 0;
+    i->extent_capacity = 0;
+}
@@ -1,72 +1,447 @@
 #include "../include/filetype.h"
+#include <errno.h>
+
+// Eviction goes by the last lookup through a directory, a cache hit skips the walk that refreshes it
+static void touch_parents(filetype *node) {
+    time_t now = time(NULL);
+    for (filetype *dir = node->parent; dir != NULL; dir = dir->parent) {
+        dir->last_used = now;
+    }
+}
+
+// Entry name[0..len) of a loaded directory. The snapshot directory is not stored in
+// the image and is not one of root's children.
+static filetype *dir_entry(filetype *dir, const char *name, size_t len) {
+    if (dir == root && len == strlen(SNAPSHOT_DIR_NAME) && memcmp(name, SNAPSHOT_DIR_NAME, len) == 0) {
+        return snapshot_directory();
+    }
+    return find_child(dir, name, len);
+}
+
+// Directory named by the first len bytes of path, without trailing slashes; len 0 is
+// the root. Walks from root one component at a time, in place, and caches the result.
+static int lookup_dir(const char *path, size_t len, filetype **out) {
+    filetype *dir;
+    if (len == 0) {
+        dir = root;
+    } else if (dcache_lookup(path, len, &dir)) {
+        if (dir == NULL) {
+            return -ENOENT;
+        }
+        touch_parents(dir);
+    } else {
+        dir = root;
+        const char *end = path + len;
+        for (const char *name = path; name < end; ) {
+            while (name < end && *name == '/') {
+                name++;
+            }
+            const char *next = name;
+            while (next < end && *next != '/') {
+                next++;
+            }
+            if (next == name) {
+                break;
+            }
+            load_children(dir); // Каталог читается из образа при первом обращении
+            if (dir->type != NODE_DIRECTORY) {
+                return -ENOTDIR;
+            }
+            filetype *child = dir_entry(dir, name, (size_t)(next - name));
+            if (child == NULL) {
+                // A directory that could not be read is not remembered as missing the entry
+                if (dir->children_loaded) {
+                    dcache_insert(path, len, NULL);
+                }
+                return -ENOENT;
+            }
+            dir = child;
+            name = next;
+        }
+        dcache_insert(path, len, dir);
+    }
+    if (dir->type != NODE_DIRECTORY) {
+        return -ENOTDIR;
+    }
+    load_children(dir);
+    *out = dir;
+    return 0;
+}
+
+// Resolves path in a single pass: the directory that holds the last component, the
+// component itself and the node it names. Nothing is allocated and path is not
+// modified, res->name points into it. For "/" only res->node is set.
+// Returns 0 when the directory exists, whether or not it has the entry.
+int resolve_path(const char *path, path_lookup *res) {
+    memset(res, 0, sizeof(*res));
+    if (path == NULL || path[0] != '/') {
+        return -EINVAL;
+    }
+
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    if (len == 1) {
+        load_children(root);
+        res->node = root;
+        return 0;
+    }
+
+    size_t start = len;
+    while (path[start - 1] != '/') {
+        start--;
+    }
+    res->name = path + start;
+    res->name_len = len - start;
+    if (res->name_len > DIRENT_NAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+
+    // Кэш путей: повторный поиск того же пути не спускается от корня
+    filetype *node;
+    int cached = dcache_lookup(path, len, &node);
+    if (cached && node != NULL) {
+        touch_parents(node);
+        load_children(node);
+        res->parent = node->parent;
+        res->node = node;
+        return 0;
+    }
+
+    size_t dir_len = start - 1;
+    while (dir_len > 0 && path[dir_len - 1] == '/') {
+        dir_len--;
+    }
+    int err = lookup_dir(path, dir_len, &res->parent);
+    if (err != 0) {
+        return err;
+    }
+    res->node = dir_entry(res->parent, res->name, res->name_len);
+    // A known miss only needed its directory, a directory that could not be read is not remembered
+    if (res->node != NULL || (!cached && res->parent->children_loaded)) {
+        dcache_insert(path, len, res->node);
+    }
+    load_children(res->node);
+    return 0;
+}
 
 filetype *filetype_from_path(const char *path) {
-    if (path == NULL) {
-        printf("NULL path provided.\n");
+    path_lookup res;
+    if (resolve_path(path, &res) != 0) {
         return NULL;
     }
+    return res.node;
+}
 
-    // Если это корневой путь, сразу возвращаем root
-    if (strcmp(path, "/") == 0) {
-        return root;
+// Reads the entries of a directory from the image the first time it is descended into
+int load_children(filetype *dir) {
+    if (dir == NULL || dir->type != NODE_DIRECTORY) {
+        return 0;
+    }
+    dir->last_used = time(NULL);
+    if (dir->children_loaded) {
+        return 0;
     }
+    if (dir == snapshot_directory()) {
+        return load_snapshots(dir);
+    }
+    return image_load_children(dir);
+}
 
-    // Используем временную копию пути, чтобы strtok не модифицировал оригинал
-    char *path_copy = strdup(path);
-    if (!path_copy) {
-        perror("Memory allocation failed for path_copy");
-        return NULL;
+static int subtree_pinned(const filetype *dir) {
+    for (int i = 0; i < dir->num_children; i++) {
+        const filetype *child = dir->children[i];
+        if (child->open_count > 0 || node_pinned(child) || subtree_pinned(child)) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    // Удаляем завершающий слэш, если есть (кроме случая с корнем, который уже обработан)
-    size_t len = strlen(path_copy);
-    if (len > 1 && path_copy[len - 1] == '/') {
-        path_copy[len - 1] = '\0';
+// Drops the loaded entries of directories not looked up since cutoff. The directory
+// node itself stays, its entries are read again from the image on the next lookup.
+// Only valid when nothing is dirty: the image must describe every evicted node.
+int evict_cold_subtrees(filetype *dir, time_t cutoff) {
+    int evicted = 0;
+    for (int i = 0; i < dir->num_children; i++) {
+        filetype *child = dir->children[i];
+        if (!child->children_loaded || child->num_children == 0) {
+            continue;
+        }
+        if (child->last_used < cutoff && !subtree_pinned(child)) {
+            for (int j = 0; j < child->num_children; j++) {
+                free_filetype(child->children[j]);
+            }
+            free(child->children);
+            free(child->child_hash);
+            child->children = NULL;
+            child->child_hash = NULL;
+            child->order_root = NULL;
+            child->num_children = 0;
+            child->children_loaded = 0;
+            evicted++;
+        } else {
+            evicted += evict_cold_subtrees(child, cutoff);
+        }
     }
+    return evicted;
+}
 
-    filetype *curr_node = root;
-    char *token;
 
-    // Начинаем токенизацию с первого символа после начального слэша
-    // Например, для "/a/b", начнем с "a/b"
-    token = strtok(path_copy + 1, "/");
 
-    while (token != NULL) {
-        int found = 0;
-        // Проверяем children, но также убедимся, что curr_node->children не NULL
-        if (curr_node->children != NULL) {
-            for (int i = 0; i < curr_node->num_children; i++) {
-                // Важная проверка на NULL для curr_node->children[i]
-                if (curr_node->children[i] != NULL && strcmp(curr_node->children[i]->name, token) == 0) {
-                    curr_node = curr_node->children[i];
-                    found = 1;
-                    break; // Найден, выходим из внутреннего цикла
-                }
+
+// The last entry takes the freed slot, listing order is kept by the ordered index
+void remove_child(filetype *parent, filetype *child) {
+    int slot = child->child_slot;
+    if (slot < 0 || slot >= parent->num_children || parent->children[slot] != child) {
+        return;
+    }
+    child_index_remove(parent, child);
+    parent->num_children--;
+    if (slot != parent->num_children) {
+        parent->children[slot] = parent->children[parent->num_children];
+        parent->children[slot]->child_slot = slot;
+    }
+    if (parent->num_children == 0) {
+        free(parent->children);
+        parent->children = NULL;
+    }
+}
+
+// FNV-1a
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; len > 0; c++, len--) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+// Stores the first len bytes of name in the name arena for the node, the old name
+// is released. A node listed in a directory must be taken out of its index first.
+int node_set_name(filetype *node, const char *name, size_t len) {
+    uint32_t ref = name_store(name, len);
+    if (ref == 0) {
+        printf("Failed to store node name of %zu bytes\n", len);
+        return -1;
+    }
+    name_release(node->name_ref);
+    node->name_ref = ref;
+    node->name_len = (uint32_t)len;
+    node->name_hash = name_hash(name_str(ref), len);
+    return 0;
+}
+
+const char *node_name(const filetype *node) {
+    return name_str(node->name_ref);
+}
+
+const char *node_type_name(node_type type) {
+    switch (type) {
+        case NODE_FILE:
+            return "file";
+        case NODE_DIRECTORY:
+            return "directory";
+        default:
+            return "none";
+    }
+}
+
+static int name_equals(const filetype *node, const char *name, size_t len) {
+    return node->name_len == len && memcmp(name_str(node->name_ref), name, len) == 0;
+}
+
+// Entry of a directory by the first len bytes of name, which need not be terminated.
+// A directory whose index could not be allocated is searched entry by entry.
+filetype *find_child(const filetype *dir, const char *name, size_t len) {
+    if (dir->child_hash == NULL) {
+        for (int i = 0; i < dir->num_children; i++) {
+            if (name_equals(dir->children[i], name, len)) {
+                return dir->children[i];
             }
         }
+        return NULL;
+    }
+    uint32_t hash = name_hash(name, len);
+    for (filetype *child = dir->child_hash[hash & dir->child_hash_mask]; child != NULL; child = child->hash_next) {
+        if (child->name_hash == hash && name_equals(child, name, len)) {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+static int order_height(const filetype *node) {
+    return node != NULL ? node->order_height : 0;
+}
+
+static filetype *order_fix(filetype *node) {
+    int left = order_height(node->order_left);
+    int right = order_height(node->order_right);
+    node->order_height = (left > right ? left : right) + 1;
+    return node;
+}
+
+static filetype *rotate_right(filetype *node) {
+    filetype *top = node->order_left;
+    node->order_left = top->order_right;
+    top->order_right = order_fix(node);
+    return order_fix(top);
+}
+
+static filetype *rotate_left(filetype *node) {
+    filetype *top = node->order_right;
+    node->order_right = top->order_left;
+    top->order_left = order_fix(node);
+    return order_fix(top);
+}
+
+// Restores the AVL invariant at node after one of its subtrees changed height by one
+static filetype *order_balance(filetype *node) {
+    int diff = order_height(node->order_left) - order_height(node->order_right);
+    if (diff > 1) {
+        if (order_height(node->order_left->order_left) < order_height(node->order_left->order_right)) {
+            node->order_left = rotate_left(node->order_left);
+        }
+        return rotate_right(node);
+    }
+    if (diff < -1) {
+        if (order_height(node->order_right->order_right) < order_height(node->order_right->order_left)) {
+            node->order_right = rotate_right(node->order_right);
+        }
+        return rotate_left(node);
+    }
+    return order_fix(node);
+}
 
-        if (!found) {
-            free(path_copy);
-            return NULL; // Дочерний элемент не найден
+static filetype *order_insert(filetype *node, filetype *entry) {
+    if (node == NULL) {
+        entry->order_left = NULL;
+        entry->order_right = NULL;
+        entry->order_height = 1;
+        return entry;
+    }
+    if (entry->cookie < node->cookie) {
+        node->order_left = order_insert(node->order_left, entry);
+    } else {
+        node->order_right = order_insert(node->order_right, entry);
+    }
+    return order_balance(node);
+}
+
+static filetype *order_remove_min(filetype *node, filetype **min) {
+    if (node->order_left == NULL) {
+        *min = node;
+        return node->order_right;
+    }
+    node->order_left = order_remove_min(node->order_left, min);
+    return order_balance(node);
+}
+
+static filetype *order_remove(filetype *node, int64_t cookie) {
+    if (node == NULL) {
+        return NULL;
+    }
+    if (cookie < node->cookie) {
+        node->order_left = order_remove(node->order_left, cookie);
+    } else if (cookie > node->cookie) {
+        node->order_right = order_remove(node->order_right, cookie);
+    } else {
+        filetype *left = node->order_left;
+        filetype *right = node->order_right;
+        node->order_left = NULL;
+        node->order_right = NULL;
+        if (right == NULL) {
+            return left;
         }
+        filetype *min;
+        right = order_remove_min(right, &min);
+        min->order_left = left;
+        min->order_right = right;
+        return order_balance(min);
+    }
+    return order_balance(node);
+}
+
+static int order_contains(const filetype *node, int64_t cookie) {
+    while (node != NULL && node->cookie != cookie) {
+        node = cookie < node->cookie ? node->order_left : node->order_right;
+    }
+    return node != NULL;
+}
 
-        token = strtok(NULL, "/"); // Получаем следующий токен
+// Entry of dir with the smallest cookie above the given one, NULL past the last.
+// readdir resumes from the offset the kernel hands back, even if entries were
+// added or removed in between.
+filetype *next_child(const filetype *dir, int64_t cookie) {
+    filetype *next = NULL;
+    for (filetype *node = dir->order_root; node != NULL; ) {
+        if (node->cookie > cookie) {
+            next = node;
+            node = node->order_left;
+        } else {
+            node = node->order_right;
+        }
     }
+    return next;
+}
 
-    free(path_copy); // Освобождаем выделенную память
-    return curr_node;
+static void link_child(filetype *dir, filetype *child) {
+    filetype **bucket = &dir->child_hash[child->name_hash & dir->child_hash_mask];
+    child->hash_next = *bucket;
+    *bucket = child;
 }
 
+// Indexes every entry of the children array into a new table of the given size
+static int rebuild_child_index(filetype *dir, uint32_t size) {
+    filetype **table = calloc(size, sizeof(filetype *));
+    if (table == NULL) {
+        perror("Failed to grow directory index");
+        return -1;
+    }
+    free(dir->child_hash);
+    dir->child_hash = table;
+    dir->child_hash_mask = size - 1;
+    for (int i = 0; i < dir->num_children; i++) {
+        link_child(dir, dir->children[i]);
+    }
+    return 0;
+}
 
+// Called by add_child once the entry is in the children array. The entry gets the
+// first free cookie for its name hash and joins the ordered index. The table doubles
+// when the entries outnumber its buckets; if that fails the old table simply gets
+// longer chains, and without any table lookups scan the array.
+void child_index_add(filetype *dir, filetype *child) {
+    child->cookie = ((int64_t)child->name_hash << DIR_COOKIE_MINOR_BITS) + DIR_COOKIE_FIRST;
+    while (order_contains(dir->order_root, child->cookie)) {
+        child->cookie++;
+    }
+    dir->order_root = order_insert(dir->order_root, child);
 
+    uint32_t size = dir->child_hash != NULL ? dir->child_hash_mask + 1 : 0;
+    if ((uint32_t)dir->num_children > size) {
+        uint32_t want = size == 0 ? CHILD_HASH_MIN : size * 2;
+        while (want < (uint32_t)dir->num_children) {
+            want *= 2;
+        }
+        if (rebuild_child_index(dir, want) == 0 || dir->child_hash == NULL) {
+            return;
+        }
+    }
+    link_child(dir, child);
+}
 
-void remove_child(filetype *parent, filetype *child) {
-    for (int i = 0; i < parent->num_children; i++) {
-        if (parent->children[i] == child) {
-            for (int j = i; j < parent->num_children - 1; j++) {
-                parent->children[j] = parent->children[j + 1];
-            }
-            parent->num_children--;
+void child_index_remove(filetype *dir, filetype *child) {
+    dir->order_root = order_remove(dir->order_root, child->cookie);
+    if (dir->child_hash == NULL) {
+        return;
+    }
+    for (filetype **link = &dir->child_hash[child->name_hash & dir->child_hash_mask]; *link != NULL; link = &(*link)->hash_next) {
+        if (*link == child) {
+            *link = child->hash_next;
+            child->hash_next = NULL;
             return;
         }
     }
@@ -0,0 +1,93 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../include/fs_init.h"
+#include "../include/flusher.h"
+#include "../include/options.h"
+#include <pthread.h>
+#include <time.h>
+
+// One lock serializes the FUSE handlers and the flusher thread.
+// In write-back mode handlers only mark state dirty and the flusher commits
+// everything that accumulated in one group: one journal sync, one msync per dirty range.
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher_thread;
+static int flusher_running = 0;
+static int flusher_stop = 0;
+
+void fs_lock() {
+    pthread_mutex_lock(&fs_mutex);
+}
+
+void fs_unlock() {
+    pthread_mutex_unlock(&fs_mutex);
+}
+
+static void *flusher_main(void *arg) {
+    (void) arg;
+    fs_lock();
+    while (!flusher_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += options.commit_interval;
+        pthread_cond_timedwait(&flusher_wake, &fs_mutex, &deadline);
+        if (flusher_stop) {
+            break;
+        }
+        if (flush_dirty_state() != 0) {
+            printf("SFS: background commit failed, retrying in %ds\n", options.commit_interval);
+        }
+    }
+    fs_unlock();
+    return NULL;
+}
+
+// Must run after fuse_main has daemonized, threads do not survive the fork
+int start_flusher() {
+    if (!options.writeback || flusher_running) {
+        return 0;
+    }
+    flusher_stop = 0;
+    if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) != 0) {
+        perror("Failed to start flusher thread");
+        options.writeback = 0; // Fall back to committing in every handler
+        return -1;
+    }
+    flusher_running = 1;
+    return 0;
+}
+
+void stop_flusher() {
+    if (!flusher_running) {
+        return;
+    }
+    fs_lock();
+    flusher_stop = 1;
+    pthread_cond_signal(&flusher_wake);
+    fs_unlock();
+    pthread_join(flusher_thread, NULL);
+    flusher_running = 0;
+}
+
+// Called with fs_lock held at the end of every modifying handler
+int commit_dirty_state() {
+    if (!options.writeback) {
+        return flush_dirty_state();
+    }
+    if (dirty_state_bytes() >= options.dirty_limit) {
+        pthread_cond_signal(&flusher_wake); // Commit early instead of waiting for the interval
+    }
+    return 0;
+}
+
+// fsync: makes sure the commit covering this node has completed. Any commit
+// writes out everything dirty, so concurrent fsyncs are satisfied by the first one.
+int commit_node(filetype *node) {
+    if (node != NULL && inode_committed(node)) {
+        return 0;
+    }
+    int ret = flush_dirty_state();
+    if (ret != 0 && node != NULL && inode_committed(node)) {
+        return 0; // Only blocks of other files stayed buffered
+    }
+    return ret;
+}
@@ -1,72 +1,76 @@
+#define _POSIX_C_SOURCE 200809L
 #include "../include/fs_init.h"
+#include <unistd.h>
 
 filetype *root;
 
 
 void print_superblock_details() {
     printf("Data blocks:\n");
-    for (size_t i = 0; i < sizeof(s_block.data_blocks); i++) {
+    for (size_t i = 0; i < (size_t)block_size * BLOCK_COUNT; i++) {
         printf("%c.", s_block.data_blocks[i]);
     }
     printf("\n");
 
     printf("Data Bitmap:\n");
-    for (size_t i = 0; i < sizeof(s_block.data_bitmap); i++) {
-        printf("%c.", s_block.data_bitmap[i]);
+    for (size_t i = 0; i < (size_t)BLOCK_COUNT; i++) {
+        printf("%d.", bitmap_test(s_block.data_bitmap, i));
     }
     printf("\n");
 
     printf("Inode Bitmap:\n");
-    for (size_t i = 0; i < sizeof(s_block.inode_bitmap); i++) {
-        printf("%c.", s_block.inode_bitmap[i]);
+    for (size_t i = 0; i < (size_t)INODE_COUNT; i++) {
+        printf("%d.", bitmap_test(s_block.inode_bitmap, i));
     }
     printf("\n");
 }
 
 
+int save_file_structure() {
+    // Every inode and directory entry record is rewritten in place
+    return image_write_tree(root);
+}
+
+
 int save_system_state() {
-    FILE *fd = fopen("file_structure.bin", "wb");
-    if (!fd) {
-        perror("Failed to open file_structure.bin for writing");
+    if (save_file_structure() != 0) {
         return -1;
     }
 
-    serialize_filetype_to_file(root, fd);
-
-    FILE *fd1 = fopen("super.bin", "wb");
-    if (!fd1) {
-        perror("Failed to open super.bin for writing");
-        fclose(fd);
+    if (image_commit_superblock() != 0) {
         return -1;
     }
 
-    serialize_superblock_to_file(&s_block, fd1);
-
-    fclose(fd);
-    fclose(fd1);
-
     return 0;
 }
 
 
 void restore_file_system() {
-    FILE *fd = fopen("file_structure.bin", "rb");
-    FILE *fd1 = fopen("super.bin", "rb");
-
-    if (fd && fd1) {
+    if (access(IMAGE_PATH, F_OK) == 0 && image_open(IMAGE_PATH, 1) == 0) {
         printf("File system restored!\n");
 
-        root = calloc(1, sizeof(filetype));
-        deserialize_filetype_from_file(root, fd);
-        deserialize_superblock_from_file(&s_block, fd1);
-        fclose(fd);
-        fclose(fd1);
+        // Only the root is read here, directories are loaded on first lookup
+        root = image_load_root();
+        if (!root) {
+            printf("SFS image has no root directory!\n");
+            exit(1);
+        }
+
+        journal_info info;
+        if (journal_replay(JOURNAL_PATH, &info) > 0) {
+            printf("Replayed %d journal records (%d applied).\n", info.records, info.applied);
+            // Replay only knows the live tree, snapshots still own their blocks
+            if (save_system_state() != 0 || image_rebuild_refcounts() != 0) {
+                exit(1);
+            }
+            dcache_clear(); // Replay looked paths up before it created or removed them
+        }
+        if (journal_open(JOURNAL_PATH) != 0) {
+            exit(1);
+        }
     } else {
         printf("SFS image not found! Please format the disk using mkfs.sfs\n");
 
-        if (fd) fclose(fd);
-        if (fd1) fclose(fd1);
-
         exit(1);  // Завершаем работу, чтобы не запускать fuse_main без ФС
     }
 }
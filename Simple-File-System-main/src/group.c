@@ -0,0 +1,115 @@
+#include "../include/superblock.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+alloc_group *groups = NULL;
+int num_groups = 0;
+
+static uint32_t blocks_per_group = 0;
+static uint32_t inodes_per_group = 0;
+
+static uint32_t round_up(uint32_t value, uint32_t unit) {
+    return (value + unit - 1) / unit * unit;
+}
+
+// Free slots of a group's slice, the first skip slots are reserved and never handed out
+static uint32_t count_free(const uint64_t *map, uint32_t first, uint32_t num, uint32_t skip) {
+    const uint64_t *slice = map + first / BITMAP_WORD_BITS;
+    uint32_t used = (uint32_t)bitmap_count(slice, num);
+    for (uint32_t k = 0; k < skip && k < num; k++) {
+        used -= (uint32_t)bitmap_test(slice, k);
+    }
+    return num > skip ? num - skip - used : 0;
+}
+
+// As in ext2, a group has as many blocks as one block of bitmap describes. The inodes
+// are spread evenly, in whole bitmap words so no word belongs to two groups.
+int groups_init() {
+    groups_close();
+    blocks_per_group = round_up(8 * (uint32_t)block_size, GROUP_ALIGN_BITS);
+    num_groups = (int)((BLOCK_COUNT + blocks_per_group - 1) / blocks_per_group);
+    inodes_per_group = round_up((INODE_COUNT + num_groups - 1) / num_groups, BITMAP_WORD_BITS);
+
+    groups = aligned_alloc(GROUP_CACHE_LINE, num_groups * sizeof(alloc_group));
+    if (groups == NULL) {
+        perror("Failed to allocate allocation groups");
+        num_groups = 0;
+        return -1;
+    }
+    for (int g = 0; g < num_groups; g++) {
+        alloc_group *group = &groups[g];
+        memset(group, 0, sizeof(*group));
+        pthread_mutex_init(&group->lock, NULL);
+        group->first_block = g * blocks_per_group;
+        group->num_blocks = g + 1 < num_groups ? blocks_per_group : BLOCK_COUNT - group->first_block;
+        // Reservations live in memory only: the on-disk bitmap never sees them,
+        // so a crash cannot leak them
+        group->reserved_map = calloc(bitmap_bytes(group->num_blocks), 1);
+        if (group->reserved_map == NULL) {
+            perror("Failed to allocate allocation groups");
+            num_groups = g + 1;
+            groups_close();
+            return -1;
+        }
+        // Trailing groups may get no inodes when the rounding used them up
+        group->first_inode = g * inodes_per_group;
+        if (group->first_inode < (uint32_t)INODE_COUNT) {
+            group->num_inodes = INODE_COUNT - group->first_inode;
+            if (group->num_inodes > inodes_per_group) {
+                group->num_inodes = inodes_per_group;
+            }
+        } else {
+            group->first_inode = INODE_COUNT;
+        }
+    }
+    groups_recount();
+    return 0;
+}
+
+// Rereads the free counters from the bitmaps, after anything that changed them
+// wholesale: formatting, journal replay, a reference count rebuild
+void groups_recount() {
+    for (int g = 0; g < num_groups; g++) {
+        alloc_group *group = &groups[g];
+        pthread_mutex_lock(&group->lock);
+        // Block 0 and inodes 0 and 1 are reserved
+        group->free_blocks = count_free(s_block.data_bitmap, group->first_block, group->num_blocks, g == 0 ? 1 : 0);
+        group->free_inodes = count_free(s_block.inode_bitmap, group->first_inode, group->num_inodes, g == 0 ? 2 : 0);
+        group->free_list_len = 0;
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+void groups_close() {
+    for (int g = 0; g < num_groups; g++) {
+        pthread_mutex_destroy(&groups[g].lock);
+        free(groups[g].reserved_map);
+        free(groups[g].free_list);
+    }
+    free(groups);
+    groups = NULL;
+    num_groups = 0;
+}
+
+int group_of_block(int block) {
+    if (block < 0 || block >= BLOCK_COUNT || num_groups == 0) {
+        return 0;
+    }
+    return (int)((uint32_t)block / blocks_per_group);
+}
+
+int group_of_inode(int number) {
+    if (number < 0 || number >= INODE_COUNT || num_groups == 0) {
+        return 0;
+    }
+    return (int)((uint32_t)number / inodes_per_group);
+}
+
+// Where the data of an inode starts out: the first block of its group
+int group_goal_block(int number) {
+    if (num_groups == 0) {
+        return 0;
+    }
+    int block = (int)groups[group_of_inode(number)].first_block;
+    return block == 0 ? 1 : block;
+}
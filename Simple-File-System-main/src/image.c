@@ -0,0 +1,1094 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../include/image.h"
+#include "../include/utilities.h"
+#include "../include/journal.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <time.h>
+
+image_header *image = NULL;
+static image_header header; // Unpacked copy of the header page, image points here while open
+static char *image_base = NULL;
+static size_t image_length = 0;
+static superblock_slot *current = NULL; // Working copy of the newest superblock slot, with its bitmaps
+static unsigned char *stale_chunks = NULL; // Per payload chunk, bit s set while slot s holds an older copy
+
+// Parent index of the live dirent area: the records of each directory are threaded
+// into one list, so loading a directory visits only its own entries. Built on the
+// first directory load and kept current by image_store_node and image_clear_node.
+typedef struct child_link {
+    int parent; // Parent number the record was linked under, -1 when unlinked
+    int first;  // First child when this inode is a directory, -1 when empty
+    int next;
+    int prev;
+} child_link;
+static child_link *child_links = NULL;
+
+static uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Bitmaps and reference counts stored after the slot header
+static size_t slot_payload(uint64_t block_count, uint64_t inode_count) {
+    return bitmap_bytes(block_count) + bitmap_bytes(inode_count) + (size_t)block_count;
+}
+
+static size_t slot_chunks(size_t payload) {
+    return (payload + SUPERBLOCK_CHUNK_SIZE - 1) / SUPERBLOCK_CHUNK_SIZE;
+}
+
+// The chunk checksums follow the slot header, the payload starts on the next chunk boundary
+static size_t slot_payload_offset(size_t payload) {
+    return align_up(SUPERBLOCK_SLOT_HEADER_SIZE + slot_chunks(payload) * sizeof(uint32_t), SUPERBLOCK_CHUNK_SIZE);
+}
+
+static uint64_t superblock_slot_size(const image_geometry *g) {
+    size_t payload = slot_payload(g->block_count, g->inode_count);
+    return align_up(slot_payload_offset(payload) + payload, IMAGE_HEADER_SIZE);
+}
+
+static uint64_t snapshot_inodes_offset(uint64_t inode_count) {
+    return align_up(SNAPSHOT_BITMAP_OFFSET + bitmap_bytes(inode_count), INODE_RECORD_SIZE);
+}
+
+static uint64_t snapshot_dirents_offset(uint64_t inode_count) {
+    return snapshot_inodes_offset(inode_count) + inode_count * INODE_RECORD_SIZE;
+}
+
+static uint64_t snapshot_slot_size(const image_geometry *g) {
+    return align_up(snapshot_dirents_offset(g->inode_count) + (uint64_t)g->inode_count * DIRENT_RECORD_SIZE,
+                    IMAGE_HEADER_SIZE);
+}
+
+void image_default_geometry(image_geometry *geometry) {
+    geometry->data_block_size = DEFAULT_BLOCK_SIZE;
+    geometry->block_count = DEFAULT_BLOCK_COUNT;
+    geometry->inode_count = DEFAULT_INODE_COUNT;
+    geometry->snapshot_slots = image_default_snapshot_slots(geometry);
+}
+
+uint64_t image_snapshot_slot_size(const image_geometry *geometry) {
+    return snapshot_slot_size(geometry);
+}
+
+// Every slot is a full copy of the inode table and the dirent area, so a large inode
+// count with a small data area would spend most of the image on empty slots. By
+// default the slots take at most 1/SNAPSHOT_SPACE_SHARE of the data area, at least one.
+uint32_t image_default_snapshot_slots(const image_geometry *geometry) {
+    uint64_t budget = (uint64_t)geometry->data_block_size * geometry->block_count / SNAPSHOT_SPACE_SHARE;
+    uint64_t slots = budget / snapshot_slot_size(geometry);
+    return slots < 1 ? 1 : slots > MAX_SNAPSHOTS ? MAX_SNAPSHOTS : (uint32_t)slots;
+}
+
+// 0 if the geometry can be laid out, otherwise prints the reason and returns -1
+int image_check_geometry(const image_geometry *g) {
+    if (g->data_block_size < MIN_BLOCK_SIZE || g->data_block_size > MAX_BLOCK_SIZE ||
+        (g->data_block_size & (g->data_block_size - 1)) != 0) {
+        fprintf(stderr, "Block size must be a power of two between %d and %d.\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+    if (g->block_count < 2 || g->block_count > MAX_BLOCK_COUNT) {
+        fprintf(stderr, "Block count must be between 2 and %u.\n", MAX_BLOCK_COUNT);
+        return -1;
+    }
+    if (g->inode_count < MIN_INODE_COUNT || g->inode_count > MAX_INODE_COUNT) {
+        fprintf(stderr, "Inode count must be between %d and %u.\n", MIN_INODE_COUNT, MAX_INODE_COUNT);
+        return -1;
+    }
+    if (g->snapshot_slots > 64) {
+        fprintf(stderr, "At most 64 snapshot slots are supported.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void attach_superblock() {
+    s_block.data_block_size = image->data_block_size;
+    s_block.block_count = image->block_count;
+    s_block.inode_count = image->inode_count;
+    s_block.data_bitmap = (uint64_t *)(current + 1);
+    s_block.inode_bitmap = (uint64_t *)((char *)s_block.data_bitmap + bitmap_bytes(image->block_count));
+    s_block.refcounts = (unsigned char *)s_block.inode_bitmap + bitmap_bytes(image->inode_count);
+    s_block.data_blocks = image_base + image->data_offset;
+}
+
+static char *slot_base(int slot) {
+    return image_base + image->superblock_offset + (size_t)slot * image->superblock_slot_size;
+}
+
+static char *chunk_sums(char *base) {
+    return base + SUPERBLOCK_SLOT_HEADER_SIZE;
+}
+
+static char *slot_data(char *base, size_t payload) {
+    return base + slot_payload_offset(payload);
+}
+
+static size_t chunk_length(size_t payload, size_t chunk) {
+    size_t rest = payload - chunk * SUPERBLOCK_CHUNK_SIZE;
+    return rest < SUPERBLOCK_CHUNK_SIZE ? rest : SUPERBLOCK_CHUNK_SIZE;
+}
+
+// Bitmap bytes at the start of the payload, stored as le64 words
+static size_t slot_bitmap_bytes() {
+    return bitmap_bytes(image->block_count) + bitmap_bytes(image->inode_count);
+}
+
+// Copies payload bytes [offset, offset + len) into the slot. Chunks start on a word
+// boundary and the bitmaps end on one, so a word never straddles two calls.
+static void store_payload(char *dst, const char *src, size_t offset, size_t len) {
+    size_t k = 0;
+    for (; k < len && offset + k < slot_bitmap_bytes(); k += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, src + k, sizeof(word));
+        put_le64(dst + k, word);
+    }
+    memcpy(dst + k, src + k, len - k);
+}
+
+static void load_payload(char *dst, const char *src, size_t len) {
+    size_t k = 0;
+    for (; k < len && k < slot_bitmap_bytes(); k += sizeof(uint64_t)) {
+        uint64_t word = get_le64(src + k);
+        memcpy(dst + k, &word, sizeof(word));
+    }
+    memcpy(dst + k, src + k, len - k);
+}
+
+// Covers the packed header and the chunk checksums, each chunk is checked against its own sum
+static uint32_t slot_checksum(char *base, size_t payload) {
+    char packed[SUPERBLOCK_SLOT_HEADER_SIZE];
+    memcpy(packed, base, sizeof(packed));
+    put_le32(packed + 8, 0);
+    uint32_t crc = crc32_buf(0, packed, sizeof(packed));
+    return crc32_buf(crc, chunk_sums(base), slot_chunks(payload) * sizeof(uint32_t));
+}
+
+superblock_slot image_superblock(int slot) {
+    superblock_slot sb;
+    unpack_superblock_slot(&sb, slot_base(slot));
+    return sb;
+}
+
+int image_superblock_valid(int slot) {
+    char *base = slot_base(slot);
+    superblock_slot sb = image_superblock(slot);
+    if (sb.sequence == 0 || sb.length != slot_payload(image->block_count, image->inode_count) ||
+        sb.checksum != slot_checksum(base, sb.length)) {
+        return 0;
+    }
+    const char *sums = chunk_sums(base);
+    const char *data = slot_data(base, sb.length);
+    for (size_t c = 0; c < slot_chunks(sb.length); c++) {
+        if (get_le32(sums + c * sizeof(uint32_t)) !=
+            crc32_buf(0, data + c * SUPERBLOCK_CHUNK_SIZE, chunk_length(sb.length, c))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void image_superblock_changed(const void *addr, size_t length) {
+    if (current == NULL || length == 0) {
+        return;
+    }
+    const char *payload = (const char *)(current + 1);
+    if ((const char *)addr < payload || (const char *)addr + length > payload + current->length) {
+        return;
+    }
+    size_t offset = (size_t)((const char *)addr - payload);
+    size_t last = (offset + length - 1) / SUPERBLOCK_CHUNK_SIZE;
+    for (size_t c = offset / SUPERBLOCK_CHUNK_SIZE; c <= last; c++) {
+        stale_chunks[c] = (1u << SUPERBLOCK_SLOTS) - 1;
+    }
+}
+
+uint64_t image_superblock_sequence() {
+    return current->sequence;
+}
+
+// Every chunk starts out stale in both slots, load_superblock clears the loaded one
+static int alloc_current() {
+    size_t payload = slot_payload(image->block_count, image->inode_count);
+    free(current);
+    free(stale_chunks);
+    current = calloc(1, sizeof(superblock_slot) + payload);
+    stale_chunks = malloc(slot_chunks(payload));
+    if (current == NULL || stale_chunks == NULL) {
+        perror("Failed to allocate superblock");
+        return -1;
+    }
+    current->length = payload;
+    memset(stale_chunks, (1u << SUPERBLOCK_SLOTS) - 1, slot_chunks(payload));
+    return 0;
+}
+
+// Picks the newest slot with a matching checksum, -1 if neither survived
+static int load_superblock() {
+    int newest = -1;
+    for (int slot = 0; slot < SUPERBLOCK_SLOTS; slot++) {
+        if (image_superblock_valid(slot) &&
+            (newest == -1 || image_superblock(slot).sequence > image_superblock(newest).sequence)) {
+            newest = slot;
+        }
+    }
+    if (newest == -1) {
+        return -1;
+    }
+    *current = image_superblock(newest);
+    load_payload((char *)(current + 1), slot_data(slot_base(newest), current->length), current->length);
+    for (size_t c = 0; c < slot_chunks(current->length); c++) {
+        stale_chunks[c] &= ~(1u << newest);
+    }
+    return 0;
+}
+
+// Writes the chunks that changed since the older slot was last committed, each
+// contiguous run with one msync, then the checksums and the header. The newer slot
+// is not touched, a crash leaves the previous commit readable.
+int image_commit_superblock() {
+    int slot = (int)((current->sequence + 1) % SUPERBLOCK_SLOTS);
+    unsigned char mask = 1u << slot;
+    char *target = slot_base(slot);
+    char *sums = chunk_sums(target);
+    char *data = slot_data(target, current->length);
+    const char *source = (const char *)(current + 1);
+    size_t chunks = slot_chunks(current->length);
+    size_t first = chunks, last = 0;
+    for (size_t c = 0; c < chunks; c++) {
+        if (stale_chunks[c] & mask) {
+            size_t len = chunk_length(current->length, c);
+            store_payload(data + c * SUPERBLOCK_CHUNK_SIZE, source + c * SUPERBLOCK_CHUNK_SIZE, c * SUPERBLOCK_CHUNK_SIZE, len);
+            put_le32(sums + c * sizeof(uint32_t), crc32_buf(0, data + c * SUPERBLOCK_CHUNK_SIZE, len));
+            if (first == chunks) first = c;
+            last = c;
+        }
+    }
+    superblock_slot packed = { current->sequence + 1, 0, (uint32_t)current->length };
+    pack_superblock_slot(&packed, target);
+    put_le32(target + 8, slot_checksum(target, current->length));
+
+    size_t c = first;
+    while (c < chunks) {
+        size_t run = c;
+        while (c < chunks && (stale_chunks[c] & mask)) {
+            c++;
+        }
+        size_t end = c == chunks ? current->length : c * SUPERBLOCK_CHUNK_SIZE;
+        if (image_sync(data + run * SUPERBLOCK_CHUNK_SIZE, end - run * SUPERBLOCK_CHUNK_SIZE) != 0) {
+            return -1;
+        }
+        while (c < chunks && !(stale_chunks[c] & mask)) {
+            c++;
+        }
+    }
+    // Written last, a header without its chunks fails the checksum and the other slot is used
+    if ((first < chunks && image_sync(sums + first * sizeof(uint32_t), (last - first + 1) * sizeof(uint32_t)) != 0) ||
+        image_sync(target, SUPERBLOCK_SLOT_HEADER_SIZE) != 0) {
+        return -1;
+    }
+    for (c = first; c <= last && c < chunks; c++) {
+        stale_chunks[c] &= ~mask;
+    }
+    current->sequence = packed.sequence;
+    return 0;
+}
+
+static int map_image(int fd, size_t length, int writable) {
+    // A read-only open still gets a private writable copy, so fsch can replay the journal in memory
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map image");
+        return -1;
+    }
+    image_base = map;
+    image_length = length;
+    return 0;
+}
+
+int image_create(const char *path, const image_geometry *g) {
+    if (image_check_geometry(g) != 0) {
+        return -1;
+    }
+    uint64_t superblock_offset = IMAGE_HEADER_SIZE;
+    uint64_t inode_table_offset = superblock_offset + SUPERBLOCK_SLOTS * superblock_slot_size(g);
+    uint64_t dirent_offset = inode_table_offset + (uint64_t)g->inode_count * INODE_RECORD_SIZE;
+    uint64_t snapshot_offset = align_up(dirent_offset + (uint64_t)g->inode_count * DIRENT_RECORD_SIZE, IMAGE_HEADER_SIZE);
+    uint64_t data_offset = snapshot_offset + g->snapshot_slots * snapshot_slot_size(g);
+    uint64_t image_size = data_offset + (uint64_t)g->data_block_size * g->block_count;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Failed to create image");
+        return -1;
+    }
+    if (ftruncate(fd, image_size) != 0) {
+        perror("Failed to size image");
+        close(fd);
+        return -1;
+    }
+    int ret = map_image(fd, image_size, 1);
+    close(fd);
+    if (ret != 0) {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = IMAGE_MAGIC;
+    header.version = IMAGE_VERSION;
+    header.data_block_size = g->data_block_size;
+    header.block_count = g->block_count;
+    header.superblock_offset = superblock_offset;
+    header.superblock_slots = SUPERBLOCK_SLOTS;
+    header.superblock_slot_size = superblock_slot_size(g);
+    header.inode_table_offset = inode_table_offset;
+    header.dirent_offset = dirent_offset;
+    header.inode_count = g->inode_count;
+    header.inode_record_size = INODE_RECORD_SIZE;
+    header.dirent_record_size = DIRENT_RECORD_SIZE;
+    header.snapshot_offset = snapshot_offset;
+    header.snapshot_slots = g->snapshot_slots;
+    header.snapshot_slot_size = snapshot_slot_size(g);
+    header.data_offset = data_offset;
+    header.image_size = image_size;
+    image = &header;
+    pack_image_header(image, image_base);
+    if (alloc_current() != 0) { // Both slots are empty until the first commit
+        image_close();
+        return -1;
+    }
+    attach_superblock();
+    if (groups_init() != 0) {
+        image_close();
+        return -1;
+    }
+    return 0;
+}
+
+int image_open(const char *path, int writable) {
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd == -1) {
+        perror("Failed to open image");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < IMAGE_HEADER_SIZE) {
+        fprintf(stderr, "Image is too small to contain a header.\n");
+        close(fd);
+        return -1;
+    }
+    int ret = map_image(fd, st.st_size, writable);
+    close(fd);
+    if (ret != 0) {
+        return -1;
+    }
+
+    unpack_image_header(&header, image_base);
+    image = &header;
+    if (image->magic != IMAGE_MAGIC || image->version != IMAGE_VERSION) {
+        fprintf(stderr, "Not an SFS image (magic %08x, version %u).\n", image->magic, image->version);
+        image_close();
+        return -1;
+    }
+    image_geometry g = { image->data_block_size, image->block_count, image->inode_count, image->snapshot_slots };
+    if (image_check_geometry(&g) != 0 ||
+        image->image_size > image_length ||
+        image->inode_record_size != INODE_RECORD_SIZE || image->dirent_record_size != DIRENT_RECORD_SIZE ||
+        image->inode_table_offset + (uint64_t)g.inode_count * INODE_RECORD_SIZE > image_length ||
+        image->dirent_offset + (uint64_t)g.inode_count * DIRENT_RECORD_SIZE > image_length ||
+        image->superblock_slots != SUPERBLOCK_SLOTS || image->superblock_slot_size != superblock_slot_size(&g) ||
+        image->superblock_offset + SUPERBLOCK_SLOTS * image->superblock_slot_size > image_length ||
+        image->snapshot_slot_size != snapshot_slot_size(&g) ||
+        image->snapshot_offset + g.snapshot_slots * image->snapshot_slot_size > image_length ||
+        image->data_offset + (uint64_t)g.data_block_size * g.block_count > image_length) {
+        fprintf(stderr, "Image header describes an unsupported or truncated layout.\n");
+        image_close();
+        return -1;
+    }
+    if (alloc_current() != 0) {
+        image_close();
+        return -1;
+    }
+    if (load_superblock() != 0) {
+        fprintf(stderr, "Image has no superblock slot with a valid checksum.\n");
+        image_close();
+        return -1;
+    }
+    attach_superblock();
+    if (groups_init() != 0) {
+        image_close();
+        return -1;
+    }
+    return 0;
+}
+
+void image_close() {
+    if (image_base != NULL) {
+        munmap(image_base, image_length);
+        image_base = NULL;
+        image_length = 0;
+        image = NULL;
+    }
+    free(current);
+    current = NULL;
+    free(stale_chunks);
+    stale_chunks = NULL;
+    free(child_links);
+    child_links = NULL;
+    groups_close();
+}
+
+char *image_inode(int number) {
+    return image_base + image->inode_table_offset + (size_t)number * INODE_RECORD_SIZE;
+}
+
+char *image_dirent(int number) {
+    return image_base + image->dirent_offset + (size_t)number * DIRENT_RECORD_SIZE;
+}
+
+// msync needs a page aligned start address
+int image_sync(const void *addr, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+    uintptr_t end = (uintptr_t)addr + length;
+    if (msync((void *)start, end - start, MS_SYNC) != 0) {
+        perror("Failed to sync image");
+        return -1;
+    }
+    return 0;
+}
+
+// Extent tree nodes of one inode, level by level, left to right
+typedef struct tree_nodes {
+    int *blocks[EXTENT_MAX_DEPTH];
+    int count[EXTENT_MAX_DEPTH];
+    int capacity[EXTENT_MAX_DEPTH];
+} tree_nodes;
+
+static int collect_node(int block, int level, const char *entries, uint32_t count, void *arg) {
+    (void) entries;
+    (void) count;
+    tree_nodes *t = arg;
+    if (t->count[level] == t->capacity[level]) {
+        int capacity = t->capacity[level] == 0 ? 16 : t->capacity[level] * 2;
+        int *list = realloc(t->blocks[level], capacity * sizeof(int));
+        if (list == NULL) {
+            return -1;
+        }
+        t->blocks[level] = list;
+        t->capacity[level] = capacity;
+    }
+    t->blocks[level][t->count[level]++] = block;
+    return 0;
+}
+
+static void free_tree_nodes(tree_nodes *t) {
+    for (int level = 0; level < EXTENT_MAX_DEPTH; level++) {
+        free(t->blocks[level]);
+    }
+}
+
+// A node identical to the one at the same position of the old tree is shared with it,
+// so appending to a long file rewrites only the last leaf and the path above it.
+// Any other node goes to a fresh block in the owner's group, old nodes are never
+// rewritten in place.
+static int place_node(const char *buf, const tree_nodes *old, int level, int position, int goal) {
+    if (position < old->count[level]) {
+        int block = old->blocks[level][position];
+        if (memcmp(s_block.data_blocks + (size_t)block * block_size, buf, block_size) == 0) {
+            block_ref(block);
+            return block;
+        }
+    }
+    int block = find_free_db_near(goal);
+    if (block == -1) {
+        return -1;
+    }
+    char *node = s_block.data_blocks + (size_t)block * block_size;
+    memcpy(node, buf, block_size);
+    if (image_sync(node, block_size) != 0) {
+        block_unref(block);
+        return -1;
+    }
+    return block;
+}
+
+// Builds the extent tree of a long run list bottom-up and returns its root
+static int write_extent_tree(inode *in, const tree_nodes *old, int *root, int *depth) {
+    int width = in->num_extents;
+    int capacity = (int)extent_leaf_capacity();
+    int nodes = (width + capacity - 1) / capacity;
+    uint32_t *first = malloc(nodes * sizeof(uint32_t));
+    int *children = malloc(nodes * sizeof(int));
+    int *placed = malloc(2 * nodes * sizeof(int)); // Nodes of all levels, to undo a failed build
+    char *buf = malloc(block_size);
+    int num_placed = 0;
+    int level = 0;
+    int goal = group_goal_block(in->number);
+    int ret = -1;
+    if (!first || !children || !placed || !buf) {
+        perror("Failed to allocate extent tree");
+        goto out;
+    }
+
+    for (int k = 0; k < nodes; k++) {
+        int count = width - k * capacity < capacity ? width - k * capacity : capacity;
+        pack_extent_leaf(in, &in->extents[k * capacity], count, buf);
+        first[k] = in->extents[k * capacity].logical;
+        if ((children[k] = place_node(buf, old, 0, k, goal)) == -1) {
+            goto out;
+        }
+        placed[num_placed++] = children[k];
+    }
+
+    // Each index level groups the nodes below it until a single root is left
+    capacity = (int)extent_index_capacity();
+    while (nodes > 1) {
+        level++;
+        width = nodes;
+        nodes = (width + capacity - 1) / capacity;
+        for (int k = 0; k < nodes; k++) {
+            int count = width - k * capacity < capacity ? width - k * capacity : capacity;
+            pack_extent_index(in, level, &first[k * capacity], &children[k * capacity], count, buf);
+            first[k] = first[k * capacity];
+            if ((children[k] = place_node(buf, old, level, k, goal)) == -1) {
+                goto out;
+            }
+            placed[num_placed++] = children[k];
+        }
+    }
+    *root = children[0];
+    *depth = level + 1;
+    ret = 0;
+
+out:
+    if (ret != 0) {
+        fprintf(stderr, "No free block for the extent tree of inode %d.\n", in->number);
+        for (int k = 0; k < num_placed; k++) {
+            block_unref(placed[k]);
+        }
+    }
+    free(first);
+    free(children);
+    free(placed);
+    free(buf);
+    return ret;
+}
+
+// A run list that outgrew the record goes to an extent tree, synced before the record
+// points at it. Nodes of the old tree lose the inode's reference, a snapshot may keep them.
+// May change the data bitmap.
+int image_store_extents(inode *in) {
+    if (!in->extents_dirty) {
+        return 0;
+    }
+    tree_nodes old;
+    memset(&old, 0, sizeof(old));
+    if (in->extent_block != 0 &&
+        walk_extent_tree(in->extent_block, in->extent_depth, in->number, collect_node, &old) != 0) {
+        memset(old.count, 0, sizeof(old.count)); // Nothing to share with
+    }
+
+    int root = 0, depth = 0;
+    if (in->num_extents > INODE_INLINE_EXTENTS && write_extent_tree(in, &old, &root, &depth) != 0) {
+        free_tree_nodes(&old);
+        return -1;
+    }
+    for (int level = 0; level < EXTENT_MAX_DEPTH; level++) {
+        for (int k = 0; k < old.count[level]; k++) {
+            block_unref(old.blocks[level][k]);
+        }
+    }
+    free_tree_nodes(&old);
+    in->extent_block = root;
+    in->extent_depth = depth;
+    in->extents_dirty = 0;
+    return 0;
+}
+
+static void unlink_child(int number) {
+    child_link *l = &child_links[number];
+    if (l->parent < 0) {
+        return;
+    }
+    if (l->prev >= 0) {
+        child_links[l->prev].next = l->next;
+    } else {
+        child_links[l->parent].first = l->next;
+    }
+    if (l->next >= 0) {
+        child_links[l->next].prev = l->prev;
+    }
+    l->parent = l->next = l->prev = -1;
+}
+
+// Moves a record to the list of the parent its dirent names now
+static void relink_child(int number) {
+    if (child_links == NULL) {
+        return;
+    }
+    int parent;
+    if (peek_dirent(image_dirent(number), &parent) == 0 || parent < 0 || parent >= (int)image->inode_count) {
+        unlink_child(number);
+        return;
+    }
+    child_link *l = &child_links[number];
+    if (l->parent == parent) {
+        return;
+    }
+    unlink_child(number);
+    l->parent = parent;
+    l->prev = -1;
+    l->next = child_links[parent].first;
+    if (l->next >= 0) {
+        child_links[l->next].prev = number;
+    }
+    child_links[parent].first = number;
+}
+
+// One pass over the dirent area. Records are linked from the highest number down,
+// so each list runs in ascending order.
+static int build_child_links() {
+    int count = (int)image->inode_count;
+    child_links = malloc((size_t)count * sizeof(child_link));
+    if (child_links == NULL) {
+        perror("Failed to allocate directory index");
+        return -1;
+    }
+    for (int n = 0; n < count; n++) {
+        child_links[n] = (child_link){ -1, -1, -1, -1 };
+    }
+    for (int n = count - 1; n >= 0; n--) {
+        relink_child(n);
+    }
+    return 0;
+}
+
+// Copies the inode and directory entry of one node into its records. Does not sync
+// the records, only new extent tree nodes. May change the data bitmap.
+int image_store_node(filetype *node) {
+    if (node->inum == NULL || node->inum->number < 0 || node->inum->number >= (int)image->inode_count) {
+        return -1;
+    }
+    if (image_store_extents(node->inum) != 0) {
+        return -1;
+    }
+    pack_inode(node->inum, image_inode(node->inum->number));
+    pack_dirent(node, image_dirent(node->inum->number));
+    relink_child(node->inum->number);
+    return 0;
+}
+
+int image_clear_node(int number) {
+    if (number < 0 || number >= (int)image->inode_count) {
+        return -1;
+    }
+    memset(image_inode(number), 0, INODE_RECORD_SIZE);
+    memset(image_dirent(number), 0, DIRENT_RECORD_SIZE);
+    if (child_links != NULL) {
+        unlink_child(number);
+    }
+    return 0;
+}
+
+// A set of inode records: the live table or the frozen copy inside a snapshot slot
+typedef struct table_view {
+    const uint64_t *bitmap;
+    const char *inodes;
+    const char *dirents;
+    int frozen;
+} table_view;
+
+static table_view live_table() {
+    table_view t = { s_block.inode_bitmap, image_inode(0), image_dirent(0), 0 };
+    return t;
+}
+
+static table_view snapshot_table(int slot) {
+    char *base = (char *)image_snapshot(slot);
+    table_view t = { (const uint64_t *)(base + SNAPSHOT_BITMAP_OFFSET), base + snapshot_inodes_offset(image->inode_count),
+                     base + snapshot_dirents_offset(image->inode_count), 1 };
+    return t;
+}
+
+// Reads one allocated inode and its directory entry, NULL for a free slot
+static filetype *load_node(const table_view *t, int number, int *parent) {
+    const char *dirent = t->dirents + (size_t)number * DIRENT_RECORD_SIZE;
+    if (!bitmap_test(t->bitmap, number) || peek_dirent(dirent, parent) == 0) {
+        return NULL;
+    }
+    filetype *node = calloc(1, sizeof(filetype));
+    // Frozen trees reuse the live numbers, they cannot share the live inode table
+    inode *inum = t->frozen ? calloc(1, sizeof(inode)) : inode_table_get(number);
+    if (!node || !inum) {
+        perror("Failed to allocate node");
+        free(node);
+        inode_free(inum);
+        return NULL;
+    }
+    if (unpack_dirent(node, dirent, parent) == 0) {
+        free(node);
+        inode_free(inum);
+        return NULL;
+    }
+    if (unpack_inode(inum, t->inodes + (size_t)number * INODE_RECORD_SIZE, NULL) != 0) {
+        fprintf(stderr, "Unreadable extent list of inode %d, its data is dropped.\n", number);
+    }
+    inum->number = number;
+    node->inum = inum;
+    node->frozen = t->frozen;
+    return node;
+}
+
+// Loads only the root directory, its entries follow on first access
+filetype *image_load_root() {
+    int count = (int)image->inode_count;
+    int parent = -1;
+    int number = (int)image->root_inode;
+    if (number <= 0 || number >= count ||
+        !bitmap_test(s_block.inode_bitmap, number) || peek_dirent(image_dirent(number), &parent) != DIRENT_DIRECTORY || parent != 0) {
+        // Header from an older build, look for the entry without a parent
+        for (number = 0; number < count; number++) {
+            if (bitmap_test(s_block.inode_bitmap, number) &&
+                peek_dirent(image_dirent(number), &parent) == DIRENT_DIRECTORY && parent == 0) {
+                break;
+            }
+        }
+        if (number == count) {
+            return NULL;
+        }
+    }
+
+    table_view t = live_table();
+    return load_node(&t, number, &parent);
+}
+
+// Attaches the entries of one directory. Inodes that already exist in memory
+// (created or moved here before the directory was loaded) are kept as they are,
+// the inode table tells without searching the directory.
+int image_load_children(filetype *dir) {
+    if (dir->children_loaded || dir->inum == NULL) {
+        return 0;
+    }
+    if (child_links == NULL && build_child_links() != 0) {
+        return -1;
+    }
+    int loaded = 0;
+    table_view t = live_table();
+    for (int n = child_links[dir->inum->number].first, next; n >= 0; n = next) {
+        next = child_links[n].next;
+        int parent;
+        if (n == dir->inum->number || !bitmap_test(s_block.inode_bitmap, n) ||
+            peek_dirent(image_dirent(n), &parent) == 0 || parent != dir->inum->number || inode_table_lookup(n) != NULL) {
+            continue;
+        }
+        filetype *node = load_node(&t, n, &parent);
+        if (node == NULL) {
+            continue;
+        }
+        node->parent = dir;
+        add_child(dir, node);
+        loaded++;
+    }
+    dir->children_loaded = 1;
+    return loaded;
+}
+
+static void mark_reachable(filetype *node, char *reachable) {
+    reachable[node->inum->number] = 1;
+    for (int i = 0; i < node->num_children; i++) {
+        filetype *child = node->children[i];
+        if (!reachable[child->inum->number]) {
+            mark_reachable(child, reachable);
+        }
+    }
+}
+
+// Bulk-loads every allocated inode and links the nodes through their parent numbers.
+// Entries that cannot be reached from the root are dropped and counted in *orphans.
+static filetype *load_table(const table_view *t, int *orphans) {
+    int count = (int)image->inode_count;
+    filetype **nodes = calloc(count, sizeof(filetype *));
+    int *parents = calloc(count, sizeof(int));
+    char *reachable = calloc(count, sizeof(char));
+    if (!nodes || !parents || !reachable) {
+        perror("Failed to allocate inode table");
+        free(nodes);
+        free(parents);
+        free(reachable);
+        return NULL;
+    }
+
+    for (int n = 0; n < count; n++) {
+        nodes[n] = load_node(t, n, &parents[n]);
+        if (nodes[n] != NULL) {
+            nodes[n]->children_loaded = 1;
+        }
+    }
+
+    filetype *tree = NULL;
+    for (int n = 0; n < count; n++) {
+        filetype *node = nodes[n];
+        if (node == NULL) {
+            continue;
+        }
+        int p = parents[n];
+        if (p == 0) {
+            if (tree == NULL) {
+                tree = node;
+            }
+            continue;
+        }
+        if (p > 0 && p < count && p != n && nodes[p] != NULL && nodes[p]->type == NODE_DIRECTORY) {
+            node->parent = nodes[p];
+            add_child(nodes[p], node);
+        }
+    }
+
+    if (tree != NULL) {
+        tree->parent = NULL;
+        mark_reachable(tree, reachable);
+    }
+
+    int dropped = 0;
+    for (int n = 0; n < count; n++) {
+        if (nodes[n] != NULL && !reachable[n]) {
+            free(nodes[n]->children); // Children are freed on their own
+            free(nodes[n]->child_hash);
+            inode_free(nodes[n]->inum);
+            name_release(nodes[n]->name_ref);
+            free(nodes[n]);
+            dropped++;
+        }
+    }
+    if (orphans != NULL) {
+        *orphans = dropped;
+    }
+
+    free(nodes);
+    free(parents);
+    free(reachable);
+    return tree;
+}
+
+filetype *image_load_tree(int *orphans) {
+    table_view t = live_table();
+    return load_table(&t, orphans);
+}
+
+static int store_subtree(filetype *node, char *seen) {
+    if (image_store_node(node) != 0) {
+        return -1;
+    }
+    seen[node->inum->number] = 1;
+    for (int i = 0; i < node->num_children; i++) {
+        if (store_subtree(node->children[i], seen) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Rewrites every record of the loaded part of the tree and clears the slots of freed inodes.
+// Each record is overwritten in place, so an interrupted rewrite is repaired by the journal.
+int image_write_tree(filetype *tree) {
+    char *seen = calloc(image->inode_count, sizeof(char));
+    if (!seen) {
+        perror("Failed to allocate inode map");
+        return -1;
+    }
+    if (store_subtree(tree, seen) != 0) {
+        fprintf(stderr, "Inode number out of range while writing the inode table.\n");
+        free(seen);
+        return -1;
+    }
+    for (int n = 0; n < (int)image->inode_count; n++) {
+        if (!seen[n] && !bitmap_test(s_block.inode_bitmap, n)) {
+            image_clear_node(n); // Allocated but not loaded records stay as they are
+        }
+    }
+    free(seen);
+    image->root_inode = tree->inum->number;
+    pack_image_header(image, image_base);
+
+    if (image_sync(image_inode(0), (size_t)image->inode_count * INODE_RECORD_SIZE) != 0 ||
+        image_sync(image_dirent(0), (size_t)image->inode_count * DIRENT_RECORD_SIZE) != 0 ||
+        image_sync(image_base, IMAGE_HEADER_SIZE) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+snapshot_header *image_snapshot(int slot) {
+    return (snapshot_header *)(image_base + image->snapshot_offset + (size_t)slot * image->snapshot_slot_size);
+}
+
+int image_find_snapshot(const char *name) {
+    for (int slot = 0; slot < (int)image->snapshot_slots; slot++) {
+        snapshot_header *snap = image_snapshot(slot);
+        if (snap->in_use && strncmp(snap->name, name, SNAPSHOT_NAME_LEN) == 0) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// Loads the frozen tree of a snapshot. Every node is marked frozen.
+filetype *image_load_snapshot(int slot, int *orphans) {
+    table_view t = snapshot_table(slot);
+    return load_table(&t, orphans);
+}
+
+static int count_node(int block, int level, const char *entries, uint32_t count, void *arg) {
+    (void) level;
+    (void) entries;
+    (void) count;
+    unsigned char *counts = arg;
+    if (counts[block] < UINT8_MAX) {
+        counts[block]++;
+    }
+    return 0;
+}
+
+static void count_table_refs(const table_view *t, unsigned char *counts) {
+    inode in;
+    for (int n = 0; n < (int)image->inode_count; n++) {
+        int parent;
+        if (!bitmap_test(t->bitmap, n) || peek_dirent(t->dirents + (size_t)n * DIRENT_RECORD_SIZE, &parent) == 0) {
+            continue;
+        }
+        unpack_inode(&in, t->inodes + (size_t)n * INODE_RECORD_SIZE, NULL);
+        for (int k = 0; k < in.num_extents; k++) {
+            for (uint32_t b = in.extents[k].start; b < in.extents[k].start + in.extents[k].length; b++) {
+                if (counts[b] < UINT8_MAX) {
+                    counts[b]++;
+                }
+            }
+        }
+        if (in.num_extents > INODE_INLINE_EXTENTS) {
+            walk_extent_tree(in.extent_block, in.extent_depth, in.number, count_node, counts);
+        }
+        extent_free(&in);
+    }
+}
+
+// Expected reference count of every data block: the live table on disk plus every snapshot.
+// counts holds one entry per data block.
+void image_count_refs(unsigned char *counts) {
+    memset(counts, 0, image->block_count);
+    table_view t = live_table();
+    count_table_refs(&t, counts);
+    for (int slot = 0; slot < (int)image->snapshot_slots; slot++) {
+        if (image_snapshot(slot)->in_use) {
+            t = snapshot_table(slot);
+            count_table_refs(&t, counts);
+        }
+    }
+}
+
+// Recomputes the reference counts and the data bitmap from the inode tables,
+// used after journal replay, which only knows about the live tree
+int image_rebuild_refcounts() {
+    unsigned char *counts = malloc(image->block_count);
+    if (counts == NULL) {
+        perror("Failed to allocate reference counts");
+        return -1;
+    }
+    image_count_refs(counts);
+    image_superblock_changed(s_block.data_bitmap, bitmap_bytes(BLOCK_COUNT));
+    image_superblock_changed(s_block.refcounts, BLOCK_COUNT);
+    for (int b = 1; b < BLOCK_COUNT; b++) {
+        s_block.refcounts[b] = counts[b];
+        if (counts[b] > 0) {
+            bitmap_set(s_block.data_bitmap, b);
+        } else {
+            bitmap_clear(s_block.data_bitmap, b);
+        }
+    }
+    free(counts);
+    groups_recount();
+    return image_commit_superblock();
+}
+
+static int add_table_refs(const table_view *t, int delta) {
+    unsigned char *counts = calloc(image->block_count, 1);
+    if (counts == NULL) {
+        perror("Failed to allocate reference counts");
+        return -1;
+    }
+    count_table_refs(t, counts);
+    for (int b = 1; b < BLOCK_COUNT; b++) {
+        for (int k = 0; k < counts[b]; k++) {
+            if (delta > 0) {
+                block_ref(b);
+            } else {
+                block_unref(b);
+            }
+        }
+    }
+    free(counts);
+    return image_commit_superblock();
+}
+
+// Freezes the inode table as it is on disk, the caller flushes first.
+// Only metadata is copied, data blocks are shared and gain one reference.
+// Returns the slot or a negative errno.
+int image_create_snapshot(const char *name) {
+    if (strlen(name) == 0 || strlen(name) >= SNAPSHOT_NAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+    if (image_find_snapshot(name) != -1) {
+        return -EEXIST;
+    }
+    int slot = 0;
+    while (slot < (int)image->snapshot_slots && image_snapshot(slot)->in_use) {
+        slot++;
+    }
+    if (slot == (int)image->snapshot_slots) {
+        return -ENOSPC;
+    }
+
+    snapshot_header *snap = image_snapshot(slot);
+    char *base = (char *)snap;
+    memset(snap, 0, sizeof(snapshot_header));
+    strcpy(snap->name, name);
+    snap->created = (uint64_t)time(NULL);
+    snap->inode_count = image->inode_count;
+    memcpy(base + SNAPSHOT_BITMAP_OFFSET, s_block.inode_bitmap, bitmap_bytes(image->inode_count));
+    memcpy(base + snapshot_inodes_offset(image->inode_count), image_inode(0), (size_t)image->inode_count * INODE_RECORD_SIZE);
+    memcpy(base + snapshot_dirents_offset(image->inode_count), image_dirent(0), (size_t)image->inode_count * DIRENT_RECORD_SIZE);
+    if (image_sync(base, image->snapshot_slot_size) != 0) {
+        return -EIO;
+    }
+
+    // References first: a crash before the slot is valid only leaks them until the next rebuild
+    table_view t = snapshot_table(slot);
+    if (add_table_refs(&t, 1) != 0) {
+        return -EIO;
+    }
+    snap->in_use = 1;
+    if (image_sync(snap, sizeof(snapshot_header)) != 0) {
+        return -EIO;
+    }
+    return slot;
+}
+
+int image_delete_snapshot(int slot) {
+    snapshot_header *snap = image_snapshot(slot);
+    if (!snap->in_use) {
+        return -ENOENT;
+    }
+    // Invalidate first, so a crash can never leave a snapshot pointing at freed blocks
+    snap->in_use = 0;
+    if (image_sync(snap, sizeof(snapshot_header)) != 0) {
+        return -EIO;
+    }
+    table_view t = snapshot_table(slot);
+    return add_table_refs(&t, -1) == 0 ? 0 : -EIO;
+}
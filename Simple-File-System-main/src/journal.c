@@ -0,0 +1,395 @@
+#define _POSIX_C_SOURCE 200809L
+#include "../include/journal.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Paths and an inode record, plus the run list of a file whose mapping outgrew the record
+#define JOURNAL_MAX_PAYLOAD (2 * JOURNAL_PATH_LEN + INODE_RECORD_SIZE + (size_t)extent_max_runs() * EXTENT_RECORD_SIZE)
+
+static int journal_fd = -1;
+static uint64_t next_seq = 1;
+static long journal_bytes = 0;
+static int journal_unsynced = 0;
+
+// Opens an empty journal for appending. Must be called after replay and checkpoint.
+int journal_open(const char *path) {
+    journal_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (journal_fd == -1) {
+        perror("Failed to open journal");
+        return -1;
+    }
+    next_seq = 1;
+    journal_bytes = 0;
+    journal_unsynced = 0;
+    return 0;
+}
+
+void journal_close() {
+    if (journal_fd != -1) {
+        journal_sync();
+        close(journal_fd);
+        journal_fd = -1;
+    }
+}
+
+static int journal_append(uint32_t type, const char *payload, uint32_t length) {
+    if (journal_fd == -1) {
+        return -1;
+    }
+
+    journal_header hdr = { JOURNAL_MAGIC, type, next_seq, length, 0 };
+    hdr.checksum = crc32_buf(crc32_buf(0, &hdr, sizeof(hdr)), payload, length);
+
+    // One write per record, so a crash can only tear the tail record
+    size_t total = sizeof(hdr) + length;
+    char *record = malloc(total);
+    if (!record) {
+        perror("Failed to allocate journal record");
+        return -1;
+    }
+    memcpy(record, &hdr, sizeof(hdr));
+    memcpy(record + sizeof(hdr), payload, length);
+
+    size_t done = 0;
+    while (done < total) {
+        ssize_t written = write(journal_fd, record + done, total - done);
+        if (written < 0) {
+            perror("Failed to append journal record");
+            free(record);
+            // Drop the torn part, records appended later would not be reachable behind it
+            if (done > 0 && ftruncate(journal_fd, journal_bytes) != 0) {
+                perror("Failed to drop torn journal record");
+            }
+            return -1;
+        }
+        done += written;
+    }
+    free(record);
+
+    next_seq++;
+    journal_bytes += total;
+    journal_unsynced = 1;
+    return 0;
+}
+
+int journal_check_path(const char *path) {
+    return strlen(path) < JOURNAL_PATH_LEN ? 0 : -ENAMETOOLONG;
+}
+
+int journal_log_path(uint32_t type, const char *path) {
+    if (journal_check_path(path) != 0) {
+        return -ENAMETOOLONG;
+    }
+    return journal_append(type, path, strlen(path) + 1);
+}
+
+int journal_log_rename(const char *from, const char *to) {
+    if (journal_check_path(from) != 0 || journal_check_path(to) != 0) {
+        return -ENAMETOOLONG;
+    }
+    size_t from_len = strlen(from) + 1;
+    size_t to_len = strlen(to) + 1;
+
+    char payload[2 * JOURNAL_PATH_LEN];
+    memcpy(payload, from, from_len);
+    memcpy(payload + from_len, to, to_len);
+    return journal_append(JR_RENAME, payload, from_len + to_len);
+}
+
+int journal_log_inode(uint32_t type, const char *path, const inode *i) {
+    if (journal_check_path(path) != 0) {
+        return -ENAMETOOLONG;
+    }
+    size_t len = strlen(path) + 1;
+
+    // Runs that do not fit into the record follow it
+    char *payload = malloc(len + INODE_RECORD_SIZE + (size_t)i->num_extents * EXTENT_RECORD_SIZE);
+    if (!payload) {
+        perror("Failed to allocate journal record");
+        return -1;
+    }
+    memcpy(payload, path, len);
+    len += pack_inode(i, payload + len);
+    len += pack_extents(i, payload + len);
+    int ret = journal_append(type, payload, len);
+    free(payload);
+    return ret;
+}
+
+int journal_sync() {
+    if (journal_fd == -1 || !journal_unsynced) {
+        return 0;
+    }
+    if (fdatasync(journal_fd) != 0) {
+        perror("Failed to sync journal");
+        return -1;
+    }
+    journal_unsynced = 0;
+    return 0;
+}
+
+// Records appended since the last journal_sync
+int journal_pending() {
+    return journal_unsynced;
+}
+
+long journal_size() {
+    return journal_bytes;
+}
+
+// Drops all records once they are contained in a checkpoint
+int journal_reset() {
+    if (journal_fd == -1) {
+        return 0;
+    }
+    if (ftruncate(journal_fd, 0) != 0 || fdatasync(journal_fd) != 0) {
+        perror("Failed to reset journal");
+        return -1;
+    }
+    next_seq = 1;
+    journal_bytes = 0;
+    journal_unsynced = 0;
+    return 0;
+}
+
+// -ENAMETOOLONG when the path does not fit, buf then holds no usable path
+int node_full_path(const filetype *node, char *buf, size_t len) {
+    if (node->parent == NULL) {
+        return snprintf(buf, len, "/") < (int)len ? 0 : -ENAMETOOLONG;
+    }
+    int err = node_full_path(node->parent, buf, len);
+    if (err != 0) {
+        return err;
+    }
+    size_t used = strlen(buf);
+    int n = snprintf(buf + used, len - used, "%s%s", used > 1 ? "/" : "", node_name(node));
+    return n >= 0 && (size_t)n < len - used ? 0 : -ENAMETOOLONG;
+}
+
+static void set_bitmap(uint64_t *bitmap, int size, int index, int value) {
+    if (index >= 0 && index < size) {
+        if (value) {
+            bitmap_set(bitmap, index);
+        } else {
+            bitmap_clear(bitmap, index);
+        }
+        image_superblock_changed(&bitmap[index / BITMAP_WORD_BITS], sizeof(uint64_t));
+    }
+}
+
+// Marks the blocks of the new inode contents as used. Blocks of the old contents stay
+// marked: a snapshot may own them, and the checkpoint after replay still allocates
+// extent blocks. The refcount rebuild that follows the checkpoint drops the stale bits.
+static void replace_inode(inode *dst, const inode *src) {
+    extent *list = dst->extents;
+    int capacity = dst->extent_capacity;
+    int table_slot = dst->table_slot;
+    *dst = *src;
+    dst->extents = list;
+    dst->extent_capacity = capacity;
+    dst->table_slot = table_slot;
+    if (extent_copy(dst, src) != 0) {
+        dst->num_extents = 0;
+        dst->blocks = 0;
+    }
+    // The extent tree named by the record may be stale, the checkpoint writes a new one
+    dst->extent_block = 0;
+    dst->extent_depth = 0;
+    dst->extents_dirty = 1;
+    for (int k = 0; k < dst->num_extents; k++) {
+        for (uint32_t b = 0; b < dst->extents[k].length; b++) {
+            set_bitmap(s_block.data_bitmap, BLOCK_COUNT, (int)(dst->extents[k].start + b), 1);
+        }
+    }
+    set_bitmap(s_block.inode_bitmap, INODE_COUNT, dst->number, 1);
+}
+
+static int replay_create(const char *path, const inode *in, node_type type) {
+    path_lookup res;
+    if (resolve_path(path, &res) != 0 || res.node == root) {
+        return 0;
+    }
+    filetype *node = res.node;
+    if (node != NULL) {
+        replace_inode(node->inum, in); // Already part of the checkpoint
+        return 1;
+    }
+    filetype *parent = res.parent;
+
+    node = calloc(1, sizeof(filetype));
+    inode *inum = inode_table_get(in->number);
+    if (!node || !inum) {
+        perror("Failed to allocate node during journal replay");
+        free(node);
+        inode_free(inum);
+        return 0;
+    }
+    if (node_set_name(node, res.name, res.name_len) != 0) {
+        free(node);
+        inode_free(inum);
+        return 0;
+    }
+    node->type = type;
+    node->valid = 1;
+    node->num_links = type == NODE_DIRECTORY ? 2 : 0;
+    node->children_loaded = 1;
+    node->parent = parent;
+    node->inum = inum;
+    replace_inode(inum, in);
+    add_child(parent, node);
+    return 1;
+}
+
+static int replay_remove(const char *path) {
+    filetype *node = filetype_from_path(path);
+    if (node == NULL || node == root || node->parent == NULL) {
+        return 0;
+    }
+    if (node->inum) {
+        // Its data blocks are dropped by the refcount rebuild after the checkpoint
+        set_bitmap(s_block.inode_bitmap, INODE_COUNT, node->inum->number, 0);
+    }
+    remove_child(node->parent, node);
+    free_filetype(node);
+    return 1;
+}
+
+static int replay_rename(const char *from, const char *to) {
+    filetype *node = filetype_from_path(from);
+    path_lookup res;
+    if (node == NULL || node == root || resolve_path(to, &res) != 0 || res.node != NULL) {
+        return 0;
+    }
+    filetype *parent = res.parent;
+
+    remove_child(node->parent, node); // The name index still knows the old name
+    if (node_set_name(node, res.name, res.name_len) != 0) {
+        add_child(node->parent, node);
+        return 0;
+    }
+    node->parent = parent;
+    add_child(parent, node);
+    return 1;
+}
+
+static int replay_inode(const char *path, const inode *in) {
+    filetype *node = filetype_from_path(path);
+    if (node == NULL || node->inum == NULL) {
+        return 0;
+    }
+    replace_inode(node->inum, in);
+    return 1;
+}
+
+static int apply_record(const journal_header *hdr, const char *payload) {
+    const char *end = memchr(payload, '\0', hdr->length);
+    if (end == NULL) {
+        return 0;
+    }
+    size_t first_len = end - payload + 1;
+
+    inode in;
+    memset(&in, 0, sizeof(in));
+    if (hdr->type == JR_MKDIR || hdr->type == JR_CREATE ||
+        hdr->type == JR_TRUNCATE || hdr->type == JR_INODE) {
+        if (hdr->length < first_len + INODE_RECORD_SIZE) {
+            return 0;
+        }
+        const char *record = payload + first_len;
+        const char *runs = record + INODE_RECORD_SIZE;
+        size_t runs_len = hdr->length - first_len - INODE_RECORD_SIZE;
+        if (runs_len % EXTENT_RECORD_SIZE != 0 ||
+            unpack_inode(&in, record, runs_len > 0 ? runs : NULL) != 0 ||
+            runs_len != (in.num_extents > INODE_INLINE_EXTENTS ? (size_t)in.num_extents * EXTENT_RECORD_SIZE : 0)) {
+            extent_free(&in);
+            return 0;
+        }
+    }
+
+    int applied;
+    switch (hdr->type) {
+        case JR_MKDIR:
+            applied = replay_create(payload, &in, NODE_DIRECTORY);
+            break;
+        case JR_CREATE:
+            applied = replay_create(payload, &in, NODE_FILE);
+            break;
+        case JR_UNLINK:
+        case JR_RMDIR:
+            applied = replay_remove(payload);
+            break;
+        case JR_RENAME:
+            if (memchr(payload + first_len, '\0', hdr->length - first_len) == NULL) {
+                return 0;
+            }
+            applied = replay_rename(payload, payload + first_len);
+            break;
+        case JR_TRUNCATE:
+        case JR_INODE:
+            applied = replay_inode(payload, &in);
+            break;
+        default:
+            applied = 0;
+            break;
+    }
+    extent_free(&in);
+    return applied;
+}
+
+// Applies every valid record to root and s_block. Stops at the first torn or corrupt record.
+int journal_replay(const char *path, journal_info *info) {
+    memset(info, 0, sizeof(*info));
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return 0; // No journal, nothing to replay
+    }
+    fseek(fp, 0, SEEK_END);
+    info->total_bytes = ftell(fp);
+    rewind(fp);
+
+    // Most records are small, the buffer grows with the longest run list seen
+    size_t payload_size = 2 * JOURNAL_PATH_LEN + INODE_RECORD_SIZE;
+    char *payload = malloc(payload_size);
+    if (!payload) {
+        fclose(fp);
+        return -1;
+    }
+
+    uint64_t expected_seq = 1;
+    journal_header hdr;
+    while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+        if (hdr.magic != JOURNAL_MAGIC || hdr.seq != expected_seq || hdr.length > JOURNAL_MAX_PAYLOAD) {
+            break;
+        }
+        if (hdr.length > payload_size) {
+            char *larger = realloc(payload, hdr.length);
+            if (!larger) {
+                perror("Failed to allocate journal record");
+                break;
+            }
+            payload = larger;
+            payload_size = hdr.length;
+        }
+        if (fread(payload, sizeof(char), hdr.length, fp) != hdr.length) {
+            break;
+        }
+        uint32_t checksum = hdr.checksum;
+        hdr.checksum = 0;
+        if (crc32_buf(crc32_buf(0, &hdr, sizeof(hdr)), payload, hdr.length) != checksum) {
+            break;
+        }
+
+        info->records++;
+        info->valid_bytes = ftell(fp);
+        info->applied += apply_record(&hdr, payload);
+        expected_seq++;
+    }
+
+    free(payload);
+    fclose(fp);
+    // Replay sets and clears bitmap bits directly
+    groups_recount();
+    return info->records;
+}
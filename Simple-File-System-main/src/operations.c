@@ -3,6 +3,7 @@
 #include "../include/operations.h"
 #include <fuse/fuse_lowlevel.h>  
 #include <sys/stat.h>
+#include <linux/falloc.h>
 
 struct fuse_operations operations =
 {
@@ -20,53 +21,256 @@ struct fuse_operations operations =
     .release=sfs_release,
     .destroy = sfs_destroy,
     .truncate = sfs_truncate,
+    .init = sfs_init,
+    .flush = sfs_flush,
+    .fsync = sfs_fsync,
+    .fsyncdir = sfs_fsyncdir,
+    .fallocate = sfs_fallocate,
 };
 
-int sfs_mkdir(const char *path, mode_t mode) {
-    (void) mode; // Explicitly cast unused parameter to void to avoid warning
+// Applies the atime mount option to an access from read, open or readdir
+static void touch_atime(filetype *node) {
+    if (node->inum == NULL || node->frozen || options.atime == ATIME_NOATIME) {
+        return;
+    }
+    time_t now = time(NULL);
+    inode *in = node->inum;
+    if (options.atime == ATIME_RELATIME && in->a_time > in->m_time && in->a_time > in->c_time &&
+        now - in->a_time < RELATIME_INTERVAL) {
+        return;
+    }
+    in->a_time = now;
+    if (options.atime == ATIME_LAZY) {
+        mark_atime_dirty(node);
+    } else {
+        mark_inode_dirty(node);
+    }
+}
 
-    printf("Creating directory: %s\n", path);
+// Returns the inode number of a removed node to the inode bitmap
+static void release_inode(filetype *node) {
+    if (node->inum == NULL) {
+        return;
+    }
+    release_inode_number(node->inum->number);
+    mark_inode_bitmap_dirty(node->inum->number);
+    mark_inode_freed(node->inum->number);
+}
 
-    // Find a free inode
-    int index = find_free_inode();
-    if (index == -1) {
-        return -ENOSPC; // No space left on device
+// Drops the file's reference to a data block, a snapshot may keep it alive
+static void release_block(int block) {
+    block_unref(block);
+    mark_data_bitmap_dirty(block);
+}
+
+// Returns the unused part of a file's preallocation to the allocator
+static void trim_prealloc(inode *in) {
+    unreserve_blocks(in->prealloc_start, in->prealloc_len);
+    in->prealloc_len = 0;
+}
+
+// Picks the data block for one file block. Appends take it from a reservation next to
+// the file's last block that doubles with every sequential append, other writes aim
+// for the block right after the one backing the previous file block.
+static int allocate_file_block(inode *in, uint32_t logical) {
+    if (in->prealloc_len > 0 && logical == in->prealloc_next) {
+        int block = in->prealloc_start;
+        in->prealloc_start++;
+        in->prealloc_len--;
+        in->prealloc_next++;
+        if (claim_reserved_block(block) != -1) {
+            return block;
+        }
     }
+    trim_prealloc(in);
 
-    // Allocate memory for the new folder
-    filetype *new_folder = malloc(sizeof(filetype));
-    if (new_folder) {
-        memset(new_folder, 0, sizeof(filetype));
+    int goal = group_goal_block(in->number); // Первый блок файла - в группе его inode
+    uint32_t prev, run;
+    if (logical > 0 && extent_lookup(in, logical - 1, &prev, &run)) {
+        goal = (int)prev + 1;
+    }
+    const extent *last = in->num_extents > 0 ? &in->extents[in->num_extents - 1] : NULL;
+    if (last != NULL && logical < last->logical + last->length) {
+        in->prealloc_window = 0; // Перезапись или дырка в середине файла, а не дописывание
+        return find_free_db_near(goal);
+    }
+
+    in->prealloc_window = in->prealloc_window == 0 ? 1 : in->prealloc_window * 2;
+    if (in->prealloc_window > PREALLOC_MAX_BLOCKS) {
+        in->prealloc_window = PREALLOC_MAX_BLOCKS;
+    }
+    int start;
+    int got = reserve_blocks(goal, in->prealloc_window, &start);
+    if (got == 0) {
+        return find_free_db_near(goal);
     }
+    in->prealloc_start = start + 1;
+    in->prealloc_len = got - 1;
+    in->prealloc_next = logical + 1;
+    return claim_reserved_block(start);
+}
 
-    strcpy(new_folder->name, "");
-    strcpy(new_folder->path, "");
-    strcpy(new_folder->type, "");
+// Small files keep their bytes in the inode record until a write takes them past
+// INODE_INLINE_DATA. A file with holes or data blocks never goes back inline.
+static int fits_inline(const inode *in, off_t end) {
+    return end <= INODE_INLINE_DATA && in->num_extents == 0 && in->num_pending == 0 &&
+           (in->data_inline || in->size == 0);
+}
 
-    new_folder->inum = calloc(1, sizeof(inode));
+// Moves inline contents into file block 0 once the file outgrows the record
+static int promote_inline(inode *in) {
+    int block = allocate_file_block(in, 0);
+    if (block == -1) {
+        return -ENOSPC;
+    }
+    int err = extent_map(in, 0, block);
+    if (err != 0) {
+        block_unref(block);
+        return err;
+    }
+    char *data = s_block.data_blocks + (size_t)block * block_size;
+    memset(data, 0, block_size);
+    memcpy(data, in->inline_data, INODE_INLINE_DATA);
+    memset(in->inline_data, 0, INODE_INLINE_DATA);
+    in->data_inline = 0;
+    mark_data_bitmap_dirty(block);
+    mark_block_dirty(block);
+    return 0;
+}
+
+// Drops the contents of a file truncated to zero, inline or in blocks
+static void truncate_contents(inode *in) {
+    trim_prealloc(in);
+    extent_truncate(in, 0, release_block); // Блоки, нужные снимку, остаются за ним
+    memset(in->inline_data, 0, INODE_INLINE_DATA);
+    in->data_inline = 0;
+    in->size = 0;
+}
 
-    // Copy the path and extract the folder name
-    char *pathname = malloc(strlen(path) + 2);
-    strcpy(pathname, path);
-    char *folder_name = strrchr(pathname, '/');
-    if (folder_name != NULL) { // Check if strrchr found '/'
-        strcpy(new_folder->name, folder_name + 1);
-        *folder_name = '\0'; // Terminate the pathname string to remove the folder name
+// Gives the file its own copy of a data block it shares with a snapshot (copy-on-write)
+static int unshare_block(inode *in, uint32_t logical, uint32_t *block) {
+    int old_block = (int)*block;
+    int new_block = allocate_file_block(in, logical);
+    if (new_block == -1) {
+        return -ENOSPC;
+    }
+    int err = extent_map(in, logical, new_block);
+    if (err != 0) {
+        block_unref(new_block);
+        return err;
     }
+    memcpy(s_block.data_blocks + (size_t)new_block * block_size, s_block.data_blocks + (size_t)old_block * block_size, block_size);
+    block_unref(old_block);
+    mark_data_bitmap_dirty(old_block);
+    mark_data_bitmap_dirty(new_block);
+    *block = (uint32_t)new_block;
+    return 0;
+}
 
-    // Set the folder path
-    if (strlen(pathname) == 0) {
-        strcpy(pathname, "/");
+// Zeroes bytes [from, to) of one file block. A hole already reads as zeros.
+static int zero_in_block(inode *in, off_t from, off_t to) {
+    uint32_t logical = (uint32_t)(from / block_size);
+    uint32_t block, run;
+    if (from >= to || !extent_lookup(in, logical, &block, &run)) {
+        return 0;
     }
-    strcpy(new_folder->path, pathname);
+    if (block_shared(block)) {
+        int err = unshare_block(in, logical, &block);
+        if (err != 0) {
+            return err;
+        }
+    }
+    memset(s_block.data_blocks + (size_t)block * block_size + from % block_size, 0, to - from);
+    mark_block_dirty(block);
+    return 0;
+}
 
-    // Get the parent folder
-    new_folder->parent = filetype_from_path(pathname);
-    if (new_folder->parent == NULL) {
-        free(new_folder->inum);
+// Sets the file size. Blocks past the new end are released and the rest of the last
+// block is zeroed, so growing the file again exposes zeros. Growing leaves a hole.
+static int resize_contents(inode *in, off_t size) {
+    if (size == 0) {
+        truncate_contents(in);
+        return 0;
+    }
+    if (in->data_inline) {
+        if (size <= INODE_INLINE_DATA) {
+            if (size < in->size) {
+                memset(in->inline_data + size, 0, in->size - size);
+            }
+            in->size = size;
+            return 0;
+        }
+        int err = promote_inline(in);
+        if (err != 0) {
+            return err;
+        }
+    }
+    if (size < in->size) {
+        trim_prealloc(in);
+        uint32_t keep = (uint32_t)((size + block_size - 1) / block_size);
+        extent_truncate(in, keep, release_block);
+        int err = zero_in_block(in, size, (off_t)keep * block_size);
+        if (err != 0) {
+            return err;
+        }
+    }
+    in->size = size;
+    return 0;
+}
+
+// Returns the snapshot name for "/.snapshots/<name>", NULL for any other path
+static const char *snapshot_name(const char *path) {
+    size_t len = strlen(SNAPSHOT_DIR_NAME) + 2;
+    if (!is_snapshot_path(path) || strlen(path) <= len || strchr(path + len, '/') != NULL) {
+        return NULL;
+    }
+    return path + len;
+}
+
+static int do_mkdir(const char *path, mode_t mode) {
+    (void) mode; // Explicitly cast unused parameter to void to avoid warning
+
+    printf("Creating directory: %s\n", path);
+
+    if (snapshot_name(path) != NULL) {
+        return snapshot_create(snapshot_name(path));
+    }
+    if (is_snapshot_path(path)) {
+        return -EROFS;
+    }
+
+    path_lookup res;
+    int err = resolve_path(path, &res);
+    if (err != 0) {
+        return err;
+    }
+    if (res.node != NULL) {
+        return -EEXIST;
+    }
+
+    filetype *new_folder = calloc(1, sizeof(filetype));
+    if (new_folder == NULL) {
+        return -ENOMEM;
+    }
+    if (node_set_name(new_folder, res.name, res.name_len) != 0) {
         free(new_folder);
-        free(pathname);
-        return -ENOENT;
+        return -ENOMEM;
+    }
+    new_folder->parent = res.parent;
+
+    // Find a free inode, in a group chosen for the new directory
+    int index = find_free_inode_near(new_folder->parent->inum->number, 1);
+    if (index == -1) {
+        name_release(new_folder->name_ref);
+        free(new_folder);
+        return -ENOSPC; // No space left on device
+    }
+    new_folder->inum = inode_table_get(index);
+    if (new_folder->inum == NULL) {
+        release_inode_number(index);
+        name_release(new_folder->name_ref);
+        free(new_folder);
+        return -ENOMEM;
     }
 
     new_folder->children = NULL;
@@ -76,9 +280,10 @@ int sfs_mkdir(const char *path, mode_t mode) {
 
     // Set the folder properties
     new_folder->num_children = 0;
+    new_folder->children_loaded = 1; // Nothing on disk to read yet
     new_folder->num_links = 2;
     new_folder->valid = 1;
-    strcpy(new_folder->type, "directory");
+    new_folder->type = NODE_DIRECTORY;
 
     // Set the inode properties
     inode *new_inode = new_folder->inum;
@@ -90,32 +295,31 @@ int sfs_mkdir(const char *path, mode_t mode) {
     new_inode->size = 0;
     new_inode->group_id = getgid();
     new_inode->user_id = getuid();
-    new_inode->number = index;
     new_inode->blocks = 0;
 
-    save_system_state();
-
-    free(pathname);
+    if (journal_log_inode(JR_MKDIR, path, new_inode) != 0) {
+        require_checkpoint(); // The directory exists in memory, the next flush writes the whole table
+    }
+    mark_inode_bitmap_dirty(index);
+    mark_inode_logged(new_folder);
+    commit_dirty_state();
 
     return 0;
 }
 
-int sfs_getattr(const char *path, struct stat *stat_buf) {
+static int do_getattr(const char *path, struct stat *stat_buf) {
     printf("Getting attributes for: %s\n", path);
 
     if (path == NULL || stat_buf == NULL) {
         return -EINVAL;
     }
 
-    char *pathname = malloc(strlen(path) + 1);
-    if (pathname == NULL) {
-        return -ENOMEM;
+    path_lookup res;
+    int err = resolve_path(path, &res);
+    if (err != 0) {
+        return err;
     }
-    strcpy(pathname, path);
-
-    filetype *file_node = filetype_from_path(pathname);
-    free(pathname);
-
+    filetype *file_node = res.node;
     if (file_node == NULL) {
         return -ENOENT;
     }
@@ -131,9 +335,9 @@ int sfs_getattr(const char *path, struct stat *stat_buf) {
     stat_buf->st_mtime = file_inode->m_time;
     stat_buf->st_ctime = file_inode->c_time;
 
-    if (strcmp(file_node->type, "file") == 0) {
+    if (file_node->type == NODE_FILE) {
         stat_buf->st_mode = S_IFREG | file_inode->permissions;
-    } else if (strcmp(file_node->type, "directory") == 0) {
+    } else if (file_node->type == NODE_DIRECTORY) {
         stat_buf->st_mode = S_IFDIR | file_inode->permissions;
     } else {
         stat_buf->st_mode = file_inode->permissions;
@@ -141,103 +345,97 @@ int sfs_getattr(const char *path, struct stat *stat_buf) {
 
     stat_buf->st_nlink = file_node->num_links + file_node->num_children;
     stat_buf->st_size = file_inode->size;
-    stat_buf->st_blocks = file_inode->blocks;
+    stat_buf->st_blksize = block_size;
+    // Дырки места не занимают, буферизованные блоки уже учтены как занятые
+    stat_buf->st_blocks = (blkcnt_t)(file_inode->blocks + file_inode->num_pending) * (block_size / 512);
 
     return 0;
 }
 
-int sfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    printf("Reading directory: %s\n", path);
-
-    // Explicitly cast unused parameters to void to avoid warnings
-    (void) offset;
-    (void) fi;
+// Streams the directory from offset on: each entry is passed with its cookie, and
+// once the kernel's buffer is full it asks again from the last cookie it got.
+static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    printf("Reading directory: %s, offset %lld\n", path, (long long)offset);
 
-    filler(buffer, ".", NULL, 0);
-    filler(buffer, "..", NULL, 0);
-
-    // Allocate memory for the pathname with correct size
-    char *pathname = malloc(strlen(path) + 1);
-    if (pathname == NULL) {
-        return -ENOMEM; // Not enough space
-    }
-    strcpy(pathname, path);
-
-    filetype *dir_node = filetype_from_path(pathname);
-    free(pathname); // Free pathname after use
+    (void) fi; // Explicitly cast unused parameter to void to avoid warning
 
+    filetype *dir_node = filetype_from_path(path);
     if (dir_node == NULL) {
         return -ENOENT; // No such file or directory
     }
+    if (dir_node->type != NODE_DIRECTORY) {
+        return -ENOTDIR;
+    }
 
-    dir_node->inum->a_time = time(NULL); // Update access time
+    touch_atime(dir_node);
 
-    for (int i = 0; i < dir_node->num_children; i++) {
-        printf(":%s:\n", dir_node->children[i]->name);
-        filler(buffer, dir_node->children[i]->name, NULL, 0);
+    if (offset < 1 && filler(buffer, ".", NULL, 1) != 0) {
+        return 0;
+    }
+    if (offset < 2 && filler(buffer, "..", NULL, 2) != 0) {
+        return 0;
+    }
+    for (filetype *child = next_child(dir_node, offset); child != NULL; child = next_child(dir_node, child->cookie)) {
+        if (filler(buffer, node_name(child), NULL, (off_t)child->cookie) != 0) {
+            return 0;
+        }
+    }
+    if (dir_node == root && offset < DIR_COOKIE_LAST) {
+        filler(buffer, SNAPSHOT_DIR_NAME, NULL, (off_t)DIR_COOKIE_LAST);
     }
 
     return 0;
 }
 
-int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+static int do_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     printf("Creating file: %s\n", path);
 
-    char *pathname = strdup(path);
-    if (!pathname) return -ENOMEM;
-
-    if (filetype_from_path(pathname) != NULL) {
-        free(pathname);
-        return -EEXIST;
+    if (is_snapshot_path(path)) {
+        return -EROFS;
     }
 
-    int index = find_free_inode();
-    if (index == -1) {
-        free(pathname);
-        return -ENOSPC;
+    path_lookup res;
+    int err = resolve_path(path, &res);
+    if (err != 0) {
+        return err;
+    }
+    if (res.node != NULL) {
+        return -EEXIST;
     }
 
     filetype *new_file = calloc(1, sizeof(filetype));
     if (!new_file) {
-        free(pathname);
         return -ENOMEM;
     }
-
-    char *folder_name = strrchr(pathname, '/');
-    if (!folder_name) {
+    if (node_set_name(new_file, res.name, res.name_len) != 0) {
         free(new_file);
-        free(pathname);
-        return -EINVAL;
+        return -ENOMEM;
     }
+    new_file->parent = res.parent;
 
-    strcpy(new_file->name, folder_name + 1);
-    *folder_name = '\0';
-
-    if (strlen(pathname) == 0) strcpy(pathname, "/");
-    strcpy(new_file->path, pathname);
-
-    new_file->parent = filetype_from_path(pathname);
-    if (!new_file->parent) {
+    // Next to the directory, in its group
+    int index = find_free_inode_near(new_file->parent->inum->number, 0);
+    if (index == -1) {
+        name_release(new_file->name_ref);
         free(new_file);
-        free(pathname);
-        return -ENOENT;
+        return -ENOSPC;
     }
 
     new_file->num_children = 0;
     add_child(new_file->parent, new_file);
-    strcpy(new_file->type, "file");
+    new_file->type = NODE_FILE;
 
-    inode *new_inode = calloc(1, sizeof(inode));
+    inode *new_inode = inode_table_get(index);
     if (!new_inode) {
         // Убедитесь, что remove_child корректно удаляет filetype из списка детей родителя
         // и free_filetype освобождает new_file
         remove_child(new_file->parent, new_file);
+        name_release(new_file->name_ref);
         free(new_file); // Освобождаем new_file, так как он был выделен
-        free(pathname);
+        release_inode_number(index);
         return -ENOMEM;
     }
 
-    new_inode->number = index;
     new_inode->blocks = 0;
     new_inode->size = 0;
     new_inode->permissions = S_IFREG | (mode & 0777);
@@ -246,176 +444,140 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     time_t now = time(NULL);
     new_inode->a_time = new_inode->m_time = new_inode->c_time = new_inode->b_time = now;
 
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        new_inode->datablocks[i] = -1;
-    }
-
     new_file->inum = new_inode;
     new_file->valid = 1;
 
     // Ключевое изменение: устанавливаем fi->fh здесь для случая, когда create объединяет open
     fi->fh = (uint64_t)new_file;
+    new_file->open_count++; // Keeps the node from being evicted while the handle exists
     printf("sfs_create: New file %s created and fi->fh set to %llu.\n", path, (unsigned long long)fi->fh);
 
-    save_system_state();
-    free(pathname);
+    if (journal_log_inode(JR_CREATE, path, new_inode) != 0) {
+        require_checkpoint();
+    }
+    mark_inode_bitmap_dirty(index);
+    mark_inode_logged(new_file);
+    commit_dirty_state();
     return 0;
 }
 
 
-int sfs_rmdir(const char *path) {
+static int do_rmdir(const char *path) {
     printf("Removing directory: %s\n", path);
 
-    char *pathname = strdup(path); // Используем strdup для безопасности и простоты
-    if (!pathname) {
-        return -ENOMEM;
+    if (snapshot_name(path) != NULL) {
+        return snapshot_delete(snapshot_name(path));
     }
-
-    char *folder_name_ptr = strrchr(pathname, '/');
-    if (!folder_name_ptr) {
-        free(pathname);
-        return -EINVAL;
+    if (is_snapshot_path(path)) {
+        return -EROFS;
     }
 
-    // ИСПРАВЛЕНИЕ: Используем strdup для корректного выделения памяти
-    char *folder_delete = strdup(folder_name_ptr + 1);
-    if (!folder_delete) {
-        free(pathname);
-        return -ENOMEM;
+    path_lookup res;
+    int err = resolve_path(path, &res);
+    if (err != 0) {
+        return err;
     }
-    *folder_name_ptr = '\0'; // Обрезаем pathname, чтобы получить путь к родителю
-
-    if (strlen(pathname) == 0) {
-        strcpy(pathname, "/");
-    }
-
-    filetype *parent = filetype_from_path(pathname);
-    free(pathname); // Освобождаем pathname как можно раньше
-
-    if (parent == NULL) {
-        free(folder_delete);
+    filetype *parent = res.parent;
+    filetype *dir = res.node;
+    if (dir == NULL) {
         return -ENOENT;
     }
-
-    int index = 0;
-    while (index < parent->num_children) {
-        if (strcmp(parent->children[index]->name, folder_delete) == 0) {
-            break;
-        }
-        index++;
+    if (parent == NULL) {
+        return -EBUSY; // Корень не удаляется
     }
-    free(folder_delete); // Освобождаем folder_delete
-
-    if (index == parent->num_children) {
-        return -ENOENT;
+    if (dir->type != NODE_DIRECTORY) {
+        return -ENOTDIR;
     }
-    if (parent->children[index]->num_children != 0) {
+    load_children(dir);
+    if (dir->num_children != 0) {
         return -ENOTEMPTY;
     }
 
-    free_filetype(parent->children[index]); // Ваша функция free_filetype должна освобождать inode и сам filetype
-
-    for (int i = index + 1; i < parent->num_children; i++) {
-        parent->children[i - 1] = parent->children[i];
+    // A path too long for a record is covered by the next checkpoint instead
+    err = journal_log_path(JR_RMDIR, path);
+    if (err == -ENAMETOOLONG) {
+        require_checkpoint();
+    } else if (err != 0) {
+        return -EIO;
     }
-    parent->num_children -= 1;
+    forget_inode_dirty(dir);
+    release_inode(dir);
+    remove_child(parent, dir);
+    free_filetype(dir); // Ваша функция free_filetype должна освобождать inode и сам filetype
 
-    save_system_state();
+    commit_dirty_state();
 
     return 0;
 }
 
 
-int sfs_rm(const char *path) {
+static int do_rm(const char *path) {
     printf("Removing file: %s\n", path);
 
-    char *pathname = strdup(path);
-    if (!pathname) return -ENOMEM;
-
-    char *folder_name_ptr = strrchr(pathname, '/');
-    if (!folder_name_ptr) {
-        free(pathname);
-        return -EINVAL;
-    }
-
-    // ИСПРАВЛЕНИЕ: Используем strdup для корректного выделения памяти
-    char *file_delete = strdup(folder_name_ptr + 1);
-    if (!file_delete) {
-        free(pathname);
-        return -ENOMEM;
-    }
-    *folder_name_ptr = '\0'; // Обрезаем pathname
-
-    if (strlen(pathname) == 0) {
-        strcpy(pathname, "/");
-    }
-
-    filetype *parent = filetype_from_path(pathname);
-    free(pathname);
-
-    if (parent == NULL) {
-        free(file_delete);
-        return -ENOENT;
+    if (is_snapshot_path(path)) {
+        return -EROFS;
     }
 
-    int index = 0;
-    while (index < parent->num_children) {
-        if (strcmp(parent->children[index]->name, file_delete) == 0) {
-            break;
-        }
-        index++;
+    path_lookup res;
+    int err = resolve_path(path, &res);
+    if (err != 0) {
+        return err;
     }
-    free(file_delete);
-
-    if (index == parent->num_children) {
+    filetype *parent = res.parent;
+    filetype *file = res.node;
+    if (file == NULL) {
         return -ENOENT;
     }
 
-    if (strcmp(parent->children[index]->type, "directory") == 0) {
+    if (file->type == NODE_DIRECTORY) {
         return -EISDIR;
     }
 
-    if (parent->children[index]->inum) {
-        for (int i = 0; i < parent->children[index]->inum->blocks; i++) {
-            if (parent->children[index]->inum->datablocks[i] != -1) {
-                s_block.data_bitmap[parent->children[index]->inum->datablocks[i]] = '0';
-            }
-        }
-        free(parent->children[index]->inum);
+    err = journal_log_path(JR_UNLINK, path);
+    if (err == -ENAMETOOLONG) {
+        require_checkpoint();
+    } else if (err != 0) {
+        return -EIO;
     }
-    free(parent->children[index]);
-
-    for (int i = index + 1; i < parent->num_children; i++) {
-        parent->children[i - 1] = parent->children[i];
+    forget_inode_dirty(file);
+    release_inode(file);
+    if (file->inum) {
+        inode *in = file->inum;
+        trim_prealloc(in);
+        extent_truncate(in, 0, release_block);
+        if (in->extent_block != 0) {
+            mark_data_bitmap_dirty(in->extent_block);
+            image_store_extents(in); // Дерево экстентов больше не нужно
+        }
     }
-    parent->num_children--;
+    remove_child(parent, file);
+    free_filetype(file);
 
-    save_system_state();
+    commit_dirty_state();
 
     return 0;
 }
 
-int sfs_open(const char *path, struct fuse_file_info *fi) {
+static int do_open(const char *path, struct fuse_file_info *fi) {
     printf("Opening file: %s\n", path);
 
-    char *pathname = strdup(path);
-    if (!pathname) {
-        return -ENOMEM;
-    }
-
-    filetype *file = filetype_from_path(pathname);
-    free(pathname);
-
-    if (file == NULL) {
+    path_lookup res;
+    int err = resolve_path(path, &res);
+    filetype *file = res.node;
+    if (err != 0 || file == NULL) {
         printf("sfs_open: ERROR: File %s not found.\n", path);
-        return -ENOENT;
+        return err != 0 ? err : -ENOENT;
     }
-    if (strcmp(file->type, "directory") == 0) {
+    if (file->type == NODE_DIRECTORY) {
         printf("sfs_open: ERROR: Attempted to open directory %s as a file.\n", path);
         return -EISDIR;
     }
+    if (file->frozen && (fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EROFS; // Снимки только для чтения
+    }
 
     fi->fh = (uint64_t)file;
+    file->open_count++;
     printf("sfs_open: File %s opened, fi->fh set to %llu (address of filetype).\n", path, (unsigned long long)fi->fh);
     printf("sfs_open: Flags: 0x%x\n", fi->flags); // Добавляем логирование флагов
 
@@ -423,43 +585,34 @@ int sfs_open(const char *path, struct fuse_file_info *fi) {
     if ((fi->flags & O_ACCMODE) != O_RDONLY && (fi->flags & O_TRUNC)) {
         printf("sfs_open: O_TRUNC flag detected. Truncating file: %s\n", path);
         if (file->inum != NULL) {
-            for (int i = 0; i < file->inum->blocks; i++) {
-                if (file->inum->datablocks[i] != -1) {
-                    s_block.data_bitmap[file->inum->datablocks[i]] = '0'; // Освобождаем блок
-                    file->inum->datablocks[i] = -1; // Обнуляем указатель в иноде
-                }
-            }
-            file->inum->size = 0;
-            file->inum->blocks = 0;
+            delalloc_drop(file, 0);
+            truncate_contents(file->inum);
             time_t now = time(NULL);
             file->inum->m_time = now;
             file->inum->c_time = now;
+            if (journal_log_inode(JR_TRUNCATE, path, file->inum) != 0) {
+                require_checkpoint();
+            }
+            mark_inode_logged(file);
         } else {
             printf("sfs_open: WARNING: Attempted to truncate file '%s' with NULL inode.\n", path);
         }
     }
 
-    if (file->inum != NULL) {
-        file->inum->a_time = time(NULL);
-    }
-
-    save_system_state();
+    touch_atime(file);
+    commit_dirty_state();
 
     return 0;
 }
 
-int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+static int do_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     printf("Reading file: %s, Size: %zu, Offset: %lld\n", path, size, (long long)offset);
 
     filetype *file = (filetype *)fi->fh;
     if (file == NULL || file->inum == NULL) {
         printf("sfs_read: ERROR: Invalid file handle (fi->fh is NULL or inode is NULL) for %s.\n", path);
         // Резервный вариант, если fi->fh не был установлен.
-        char *pathname_backup = strdup(path);
-        if (pathname_backup) {
-            file = filetype_from_path(pathname_backup);
-            free(pathname_backup);
-        }
+        file = filetype_from_path(path);
         if (file == NULL || file->inum == NULL) {
             printf("sfs_read: Critical Error: Could not recover filetype for %s. Returning -EIO.\n", path);
             return -EIO;
@@ -467,15 +620,15 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
         printf("sfs_read: Recovered filetype for %s via path lookup.\n", path);
     }
 
-    printf("sfs_read: File found: %s, current size: %d, blocks: %d\n", file->name, file->inum->size, file->inum->blocks);
+    printf("sfs_read: File found: %s, current size: %lld, blocks: %d\n", node_name(file), (long long)file->inum->size, file->inum->blocks);
 
-    if (strcmp(file->type, "directory") == 0) {
+    if (file->type == NODE_DIRECTORY) {
         printf("sfs_read: ERROR: Attempted to read from directory %s.\n", path);
         return -EISDIR;
     }
 
     if (offset >= (off_t)file->inum->size) {
-        printf("sfs_read: Offset %lld >= file size %d. Returning 0 bytes read.\n", (long long)offset, file->inum->size);
+        printf("sfs_read: Offset %lld >= file size %lld. Returning 0 bytes read.\n", (long long)offset, (long long)file->inum->size);
         return 0;
     }
 
@@ -489,40 +642,64 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
         return 0;
     }
 
-    file->inum->a_time = time(NULL);
-
     ssize_t current_read_offset = 0; // Используем ssize_t для счетчика прочитанных байт
 
+    if (file->inum->data_inline) {
+        // Данные лежат прямо в записи inode, блоков нет
+        memcpy(buf, file->inum->inline_data + offset, bytes_to_read_size_t);
+        current_read_offset = (ssize_t)bytes_to_read_size_t;
+    }
+
     while (current_read_offset < (ssize_t)bytes_to_read_size_t) {
-        int current_block_idx_in_inode = (offset + current_read_offset) / block_size;
+        uint32_t current_block_idx_in_inode = (uint32_t)((offset + current_read_offset) / block_size);
         size_t current_offset_in_block = (offset + current_read_offset) % block_size;
-
-        if (current_block_idx_in_inode >= MAX_BLOCKS || file->inum->datablocks[current_block_idx_in_inode] == -1) {
-            printf("sfs_read: WARNING: Attempted to read from unallocated block at inode index %d for file %s. Only %zd bytes were readable.\n", current_block_idx_in_inode, path, current_read_offset);
-            break; // Если блок не выделен, прекращаем чтение
+        uint32_t data_block_num, run_blocks;
+
+        if (!extent_lookup(file->inum, current_block_idx_in_inode, &data_block_num, &run_blocks)) {
+            size_t hole_bytes = bytes_to_read_size_t - current_read_offset;
+            if (file->inum->num_pending > 0) {
+                // Блок может ждать в буфере записи, пока ему не выбрали место
+                char *pending = delalloc_find(file->inum, current_block_idx_in_inode);
+                if (hole_bytes > (size_t)block_size - current_offset_in_block) {
+                    hole_bytes = (size_t)block_size - current_offset_in_block;
+                }
+                if (pending != NULL) {
+                    memcpy(buf + current_read_offset, pending + current_offset_in_block, hole_bytes);
+                    current_read_offset += hole_bytes;
+                    continue;
+                }
+            }
+            // Дырка: невыделенные блоки читаются как нули, ничего не выделяя
+            if (run_blocks != UINT32_MAX && (size_t)run_blocks * block_size - current_offset_in_block < hole_bytes) {
+                hole_bytes = (size_t)run_blocks * block_size - current_offset_in_block;
+            }
+            memset(buf + current_read_offset, 0, hole_bytes);
+            current_read_offset += hole_bytes;
+            continue;
         }
 
-        int data_block_num = file->inum->datablocks[current_block_idx_in_inode];
-        size_t bytes_left_in_current_block = block_size - current_offset_in_block;
+        // Весь остаток экстента лежит подряд: копируем его одним memcpy
+        size_t bytes_left_in_run = (size_t)run_blocks * block_size - current_offset_in_block;
         size_t bytes_to_copy_this_iter = bytes_to_read_size_t - current_read_offset;
 
-        if (bytes_to_copy_this_iter > bytes_left_in_current_block) {
-            bytes_to_copy_this_iter = bytes_left_in_current_block;
+        if (bytes_to_copy_this_iter > bytes_left_in_run) {
+            bytes_to_copy_this_iter = bytes_left_in_run;
         }
 
         memcpy(buf + current_read_offset,
-               s_block.data_blocks + data_block_num * block_size + current_offset_in_block,
+               s_block.data_blocks + (size_t)data_block_num * block_size + current_offset_in_block,
                bytes_to_copy_this_iter);
 
         current_read_offset += bytes_to_copy_this_iter;
     }
 
-    save_system_state();
+    touch_atime(file);
+    commit_dirty_state();
     printf("sfs_read: Successfully read %zd bytes from file %s. Total read: %zd.\n", current_read_offset, path, current_read_offset);
     return (int)current_read_offset; // Приводим к int при возврате
 }
 
-int sfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+static int do_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     printf("Writing to file: %s, Size: %zu, Offset: %lld\n", path, size, (long long)offset);
 
     // Добавляем логирование содержимого буфера для отладки
@@ -538,11 +715,7 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset, stru
     if (file == NULL || file->inum == NULL) {
         printf("sfs_write: ERROR: Invalid file handle (fi->fh is NULL or inode is NULL) for %s.\n", path);
         // Резервный вариант, если fi->fh не был установлен (например, если FUSE вызвал create без open)
-        char *pathname_backup = strdup(path);
-        if (pathname_backup) {
-            file = filetype_from_path(pathname_backup);
-            free(pathname_backup);
-        }
+        file = filetype_from_path(path);
         if (file == NULL || file->inum == NULL) {
             printf("sfs_write: Critical Error: Could not recover filetype for %s. Returning -EIO.\n", path);
             return -EIO;
@@ -550,12 +723,15 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset, stru
         printf("sfs_write: Recovered filetype for %s via path lookup.\n", path);
     }
 
-    printf("sfs_write: File found: %s, current size: %d, blocks: %d\n", file->name, file->inum->size, file->inum->blocks);
+    printf("sfs_write: File found: %s, current size: %lld, blocks: %d\n", node_name(file), (long long)file->inum->size, file->inum->blocks);
 
-    if (strcmp(file->type, "directory") == 0) {
+    if (file->type == NODE_DIRECTORY) {
         printf("sfs_write: ERROR: Attempted to write to directory %s.\n", path);
         return -EISDIR;
     }
+    if (file->frozen) {
+        return -EROFS;
+    }
 
     if (size == 0) {
         printf("sfs_write: Zero size write, returning 0.\n");
@@ -563,76 +739,109 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset, stru
     }
 
     if ((unsigned long long)offset + size > MAX_FILE_SIZE) {
-        printf("sfs_write: ERROR: Attempted write exceeds MAX_FILE_SIZE (%lu bytes) for file %s.\n",
-               (unsigned long)MAX_FILE_SIZE, path);
+        printf("sfs_write: ERROR: Attempted write exceeds MAX_FILE_SIZE (%llu bytes) for file %s.\n",
+               MAX_FILE_SIZE, path);
         return -EFBIG; // File too large
     }
 
     time_t now = time(NULL);
     file->inum->m_time = now;
     file->inum->a_time = now;
+    mark_inode_dirty(file);
 
     ssize_t remaining_bytes_to_write = size;
     ssize_t bytes_written_total = 0;
 
+    if (fits_inline(file->inum, offset + (off_t)size)) {
+        // Маленький файл целиком помещается в запись inode: блок не выделяем
+        memcpy(file->inum->inline_data + offset, buf, size);
+        file->inum->data_inline = 1;
+        if (offset + (off_t)size > file->inum->size) {
+            file->inum->size = offset + (off_t)size;
+        }
+        commit_dirty_state();
+        printf("sfs_write: Wrote %zu bytes inline to file %s. New size: %lld.\n", size, path, (long long)file->inum->size);
+        return (int)size;
+    }
+    if (file->inum->data_inline) {
+        int err = promote_inline(file->inum);
+        if (err != 0) {
+            printf("sfs_write: ERROR: Could not move inline data of file %s to a data block.\n", path);
+            commit_dirty_state();
+            return err;
+        }
+        printf("sfs_write: File %s outgrew the inode record, its data moved to a block.\n", path);
+    }
+
     // Расширяем файл, если offset больше текущего размера. Это создает "дырку" (sparse file).
     if (offset > (off_t)file->inum->size) {
-        printf("sfs_write: INFO: Offset %lld is beyond current file size %d. Updating file size to %lld.\n",
-               (long long)offset, file->inum->size, (long long)offset);
+        printf("sfs_write: INFO: Offset %lld is beyond current file size %lld. Updating file size to %lld.\n",
+               (long long)offset, (long long)file->inum->size, (long long)offset);
         file->inum->size = offset;
     }
 
     while (remaining_bytes_to_write > 0) {
-        int current_block_idx_in_inode = (offset + bytes_written_total) / block_size;
+        uint32_t current_block_idx_in_inode = (uint32_t)((offset + bytes_written_total) / block_size);
         size_t current_offset_in_block = (offset + bytes_written_total) % block_size;
+        uint32_t data_block_num_in_super, run_blocks;
 
-        if (current_block_idx_in_inode >= MAX_BLOCKS) {
-            printf("sfs_write: ERROR: Exceeded MAX_BLOCKS (%d) for inode for file %s. Wrote %zd bytes so far.\n",
-                   MAX_BLOCKS, path, bytes_written_total);
-            save_system_state();
-            return (int)bytes_written_total; // Возвращаем то, что успели записать
+        if (delalloc_bytes() >= (long)DELALLOC_MAX_BLOCKS * block_size) {
+            delalloc_flush_all(); // Буферы разрослись: размещаем их, не дожидаясь сброса
         }
 
         // Если текущий блок еще не выделен (т.е. это "дырка" или новый блок в конце файла)
-        if (file->inum->datablocks[current_block_idx_in_inode] == -1) {
-            int new_db_num = find_free_db();
-            if (new_db_num == -1) {
-                printf("sfs_write: ERROR: No free data blocks to allocate for file %s. Wrote %zd bytes so far.\n",
+        if (!extent_lookup(file->inum, current_block_idx_in_inode, &data_block_num_in_super, &run_blocks)) {
+            // Данные копятся в буфере, блок данных выберет delalloc_flush_node (буфер уже обнулён)
+            int err = 0;
+            char *pending = delalloc_get(file, current_block_idx_in_inode, &err);
+            if (pending == NULL) {
+                printf("sfs_write: ERROR: No space to buffer a block of file %s. Wrote %zd bytes so far.\n",
                        path, bytes_written_total);
-                save_system_state();
-                return -ENOSPC; // Возвращаем то, что успели записать
+                commit_dirty_state();
+                return bytes_written_total > 0 ? (int)bytes_written_total : err;
             }
-            file->inum->datablocks[current_block_idx_in_inode] = new_db_num;
-            s_block.data_bitmap[new_db_num] = '1'; // Отмечаем блок как занятый
-            printf("sfs_write: Allocated new data block %d at inode index %d for file %s.\n",
-                   new_db_num, current_block_idx_in_inode, path);
-
-            // Если новый блок выделяется не с самого начала (например, если offset не кратен block_size
-            // или если мы заполняем дырку в середине файла), нужно обнулить его часть,
-            // которая не будет заполнена текущей записью.
-            // Это обеспечивает, что не будет "мусора" при последующем чтении.
-            // Исключение: если мы пишем точно с начала блока и до его конца, memset не нужен.
-            if (current_offset_in_block != 0) {
-                // Если запись начинается не с начала блока, обнуляем часть до смещения
-                memset(s_block.data_blocks + new_db_num * block_size, 0, current_offset_in_block);
-                printf("sfs_write: Initialized new data block %d (before offset %zu) with zeros.\n", new_db_num, current_offset_in_block);
+            size_t bytes_to_copy_this_iter = (size_t)block_size - current_offset_in_block;
+            if (bytes_to_copy_this_iter > (size_t)remaining_bytes_to_write) {
+                bytes_to_copy_this_iter = (size_t)remaining_bytes_to_write;
             }
+            memcpy(pending + current_offset_in_block, buf + bytes_written_total, bytes_to_copy_this_iter);
+            bytes_written_total += bytes_to_copy_this_iter;
+            remaining_bytes_to_write -= bytes_to_copy_this_iter;
+            if ((off_t)(offset + bytes_written_total) > (off_t)file->inum->size) {
+                file->inum->size = (offset + bytes_written_total);
+            }
+            continue;
+        } else if (block_shared(data_block_num_in_super)) {
+            // Блок принадлежит ещё и снимку: копируем его перед записью (copy-on-write)
+            uint32_t old_db_num = data_block_num_in_super;
+            int err = unshare_block(file->inum, current_block_idx_in_inode, &data_block_num_in_super);
+            if (err != 0) {
+                commit_dirty_state();
+                return bytes_written_total > 0 ? (int)bytes_written_total : err;
+            }
+            printf("sfs_write: Copied shared data block %u to %u for file %s.\n", old_db_num, data_block_num_in_super, path);
+            run_blocks = 1;
+        } else {
+            // Пишем подряд, пока блоки экстента не разделены со снимком
+            uint32_t needed = (uint32_t)((current_offset_in_block + remaining_bytes_to_write + block_size - 1) / block_size);
+            uint32_t own = 1;
+            while (own < run_blocks && own < needed && !block_shared(data_block_num_in_super + own)) {
+                own++;
+            }
+            run_blocks = own;
         }
 
-        // Обновляем количество блоков в inode, если мы выделили блок за пределами текущего `blocks`
-        if (current_block_idx_in_inode >= file->inum->blocks) {
-            file->inum->blocks = current_block_idx_in_inode + 1;
-        }
-
-        int data_block_num_in_super = file->inum->datablocks[current_block_idx_in_inode];
-        size_t space_left_in_current_block = block_size - current_offset_in_block;
+        size_t space_left_in_run = (size_t)run_blocks * block_size - current_offset_in_block;
         size_t bytes_to_copy_this_iter = (size_t)remaining_bytes_to_write;
-        if (bytes_to_copy_this_iter > space_left_in_current_block) {
-            bytes_to_copy_this_iter = space_left_in_current_block;
+        if (bytes_to_copy_this_iter > space_left_in_run) {
+            bytes_to_copy_this_iter = space_left_in_run;
         }
 
-        memcpy(s_block.data_blocks + data_block_num_in_super * block_size + current_offset_in_block,
+        memcpy(s_block.data_blocks + (size_t)data_block_num_in_super * block_size + current_offset_in_block,
                buf + bytes_written_total, bytes_to_copy_this_iter);
+        for (uint32_t k = 0; k < run_blocks; k++) {
+            mark_block_dirty(data_block_num_in_super + k);
+        }
 
         bytes_written_total += bytes_to_copy_this_iter;
         remaining_bytes_to_write -= bytes_to_copy_this_iter;
@@ -643,93 +852,88 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset, stru
         }
     }
 
-    save_system_state();
-    printf("sfs_write: Successfully wrote %zd bytes to file %s. New size: %d.\n", bytes_written_total, path, file->inum->size);
+    commit_dirty_state();
+    printf("sfs_write: Successfully wrote %zd bytes to file %s. New size: %lld.\n", bytes_written_total, path, (long long)file->inum->size);
     return (int)bytes_written_total; // Приводим к int при возврате
 }
 
-int sfs_release(const char *path, struct fuse_file_info *fi) {
+static int do_release(const char *path, struct fuse_file_info *fi) {
     printf("Releasing file: %s\n", path);
-    save_system_state(); // Сохраняем состояние ФС при закрытии файла
-    (void) path; // Отключаем предупреждение о неиспользуемом параметре
-    (void) fi;   // Отключаем предупреждение о неиспользуемом параметре
+    filetype *file = (filetype *)fi->fh;
+    if (file != NULL && file->open_count > 0) {
+        file->open_count--;
+        if (file->open_count == 0 && file->inum != NULL) {
+            // Последний дескриптор закрыт: буферы получают блоки, резерв больше не нужен
+            if (delalloc_flush_node(file) != 0) {
+                printf("sfs_release: WARNING: Buffered data of %s stays in memory until the next flush.\n", path);
+            }
+            trim_prealloc(file->inum);
+        }
+    }
+    commit_dirty_state(); // Сохраняем состояние ФС при закрытии файла
     return 0;
 }
 
-int sfs_rename(const char *from, const char *to) {
+static int do_rename(const char *from, const char *to) {
     printf("Renaming file/directory from %s to %s\n", from, to);
 
-    filetype *from_node = filetype_from_path(from);
-    if (from_node == NULL) {
-        return -ENOENT;
+    if (is_snapshot_path(from) || is_snapshot_path(to)) {
+        return -EROFS;
     }
 
-    char *dest_name = get_file_name(to);
-    char *path_to = get_file_path(to);
-    char *path_from = get_file_path(from);
-    char *from_name = get_file_name(from); // нужно заранее сохранить имя from
-
-    filetype *to_dir = filetype_from_path(to);
-    if (to_dir == NULL) {
-        filetype *parent_dir_from = filetype_from_path(path_from);
-        filetype *parent_dir_to = filetype_from_path(path_to);
-        if (parent_dir_from == NULL || parent_dir_to == NULL) {
-            free(dest_name);
-            free(path_to);
-            free(path_from);
-            free(from_name);
-            return -ENOENT;
-        }
-
-        for (int i = 0; i < parent_dir_from->num_children; i++) {
-            if (strcmp(parent_dir_from->children[i]->name, from_name) == 0) {
-                if (strcmp(dest_name, from_name) != 0) {
-                    strcpy(parent_dir_from->children[i]->name, dest_name);
-                }
-
-                char *to_file_path = get_file_path(to); // временно
-                strcpy(parent_dir_from->children[i]->path, to_file_path);
-                free(to_file_path); // освобождаем
-
-                add_child(parent_dir_to, parent_dir_from->children[i]);
-
-                for (int j = i + 1; j < parent_dir_from->num_children; j++) {
-                    parent_dir_from->children[j - 1] = parent_dir_from->children[j];
-                }
-                parent_dir_from->num_children--;
-
-                break;
-            }
+    path_lookup src, dst;
+    int err = resolve_path(from, &src);
+    if (err != 0) {
+        return err;
+    }
+    filetype *moved = src.node;
+    if (moved == NULL) {
+        return -ENOENT;
+    }
+    if (src.parent == NULL) {
+        return -EBUSY;
+    }
+    err = resolve_path(to, &dst);
+    if (err != 0) {
+        return err;
+    }
+    if (dst.node != NULL) {
+        return -EEXIST;
+    }
+    // Каталог нельзя перенести внутрь самого себя
+    for (filetype *dir = dst.parent; dir != NULL; dir = dir->parent) {
+        if (dir == moved) {
+            return -EINVAL;
         }
+    }
 
-        printf("To - %s %s : From - %s %s\n", path_to, dest_name, path_from, from_name);
-
-        save_system_state();
-
-        // освобождаем память
-        free(dest_name);
-        free(path_to);
-        free(path_from);
-        free(from_name);
-
-        return 0;
+    // Индекс имён строится по старому имени: сначала убираем узел из каталога
+    remove_child(src.parent, moved);
+    if (node_set_name(moved, dst.name, dst.name_len) != 0) {
+        add_child(src.parent, moved);
+        return -ENOMEM;
     }
+    moved->parent = dst.parent;
+    add_child(dst.parent, moved);
 
-    // освобождаем, если дошли сюда (файл уже существует)
-    free(dest_name);
-    free(path_to);
-    free(path_from);
-    free(from_name);
+    if (journal_log_rename(from, to) != 0) {
+        require_checkpoint(); // A path too long for a record, the table rewrite covers the move
+    }
+    mark_inode_dirty(moved); // Name and parent live in its dirent record
+    commit_dirty_state();
 
-    return -EEXIST; // например, если переименование не удалось
+    return 0;
 }
 
 
-int sfs_utimens(const char *path, const struct timespec tv[2]) {
+static int do_utimens(const char *path, const struct timespec tv[2]) {
     filetype *file = filetype_from_path(path);
     if (file == NULL) {
         return -ENOENT; // File not found
     }
+    if (file->frozen) {
+        return -EROFS;
+    }
 
     time_t currentTime = time(NULL); // Fetch current time once, if needed
 
@@ -742,7 +946,8 @@ int sfs_utimens(const char *path, const struct timespec tv[2]) {
         file->inum->m_time = (tv[1].tv_nsec == UTIME_NOW) ? currentTime : tv[1].tv_sec;
     }
 
-    save_system_state();
+    mark_inode_dirty(file);
+    commit_dirty_state();
 
     return 0;
 }
@@ -750,51 +955,354 @@ int sfs_utimens(const char *path, const struct timespec tv[2]) {
 void sfs_destroy(void *private_data) {
     (void) private_data; // Отключаем предупреждение о неиспользуемом параметре
     printf("SFS: Destroying file system. Freeing all resources.\n");
+    stop_flusher();
+    fs_lock();
+    flush_dirty_state();
+    close_dirty_state();
+    name_stats names = names_get_stats();
+    printf("SFS: name arena %ld names in %zu of %zu bytes\n", names.names, names.used_bytes, names.chunk_bytes);
+    close_snapshots();
     free_filetype(root); // Теперь это безопасное место для освобождения
     root = NULL; // Обнуляем указатель после освобождения
+    inode_table_close();
+    dcache_close();
+    names_close();
+    fs_unlock();
     // Освободите здесь любые другие глобальные ресурсы, если они есть.
     // Например, если s_block выделялся динамически, то free(s_block);
     // Но так как s_block - это глобальная переменная, она будет очищена при выходе из программы.
     // Главное - очистить все, что было выделено динамически.
 }
 
-int sfs_truncate(const char *path, off_t size) {
+static int do_truncate(const char *path, off_t size) {
     printf("sfs_truncate: Truncating file %s to size %lld\n", path, (long long)size);
 
-    // Временная реализация: найти файл и обрезать его
     filetype *file = filetype_from_path(path);
     if (file == NULL) {
         return -ENOENT;
     }
-    if (strcmp(file->type, "directory") == 0) {
+    if (file->type == NODE_DIRECTORY) {
         return -EISDIR;
     }
+    if (file->frozen) {
+        return -EROFS;
+    }
 
-    // Если размер 0, то освобождаем все блоки
-    if (size == 0) {
-        if (file->inum != NULL) {
-            for (int i = 0; i < file->inum->blocks; i++) {
-                if (file->inum->datablocks[i] != -1) {
-                    s_block.data_bitmap[file->inum->datablocks[i]] = '0'; // Освобождаем блок
-                    file->inum->datablocks[i] = -1; // Обнуляем указатель в иноде
-                }
-            }
-            file->inum->size = 0;
-            file->inum->blocks = 0;
-            time_t now = time(NULL);
-            file->inum->m_time = now;
-            file->inum->c_time = now;
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if ((unsigned long long)size > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+    if (file->inum != NULL) {
+        // Буферы за новым концом выбрасываются, не получив блоков
+        delalloc_drop(file, (uint32_t)((size + block_size - 1) / block_size));
+        int err = delalloc_flush_node(file);
+        if (err == 0) {
+            err = resize_contents(file->inum, size);
+        }
+        time_t now = time(NULL);
+        file->inum->m_time = now;
+        file->inum->c_time = now;
+        if (journal_log_inode(JR_TRUNCATE, path, file->inum) != 0) {
+            require_checkpoint();
+        }
+        mark_inode_logged(file);
+        if (err != 0) {
+            commit_dirty_state();
+            return err;
         }
-    } else {
-        // Если size > 0, то тут должна быть логика расширения или сжатия файла.
-        // Пока что для теста можно просто вернуть 0 или -EINVAL.
-        // В реальной ФС, если размер больше текущего, нужно выделить блоки.
-        // Если меньше, освободить лишние.
-        printf("sfs_truncate: WARNING: Truncating to non-zero size %lld is not fully implemented yet for %s.\n", (long long)size, path);
-        return -EINVAL; // Временно, пока не реализуете
     }
 
-    save_system_state();
+    commit_dirty_state();
     return 0;
 }
 
+// Maps zeroed blocks to the holes of [offset, offset + len)
+static int preallocate_range(inode *in, off_t offset, off_t len) {
+    if (fits_inline(in, offset + len)) {
+        in->data_inline = 1; // Место уже есть в записи inode
+        return 0;
+    }
+    if (in->data_inline) {
+        int err = promote_inline(in);
+        if (err != 0) {
+            return err;
+        }
+    }
+    uint32_t logical = (uint32_t)(offset / block_size);
+    uint32_t last = (uint32_t)((offset + len - 1) / block_size);
+    while (logical <= last) {
+        uint32_t block, run;
+        if (extent_lookup(in, logical, &block, &run)) {
+            logical = run > last - logical ? last + 1 : logical + run;
+            continue;
+        }
+        int new_block = allocate_file_block(in, logical);
+        if (new_block == -1) {
+            return -ENOSPC;
+        }
+        int err = extent_map(in, logical, new_block);
+        if (err != 0) {
+            block_unref(new_block);
+            return err;
+        }
+        memset(s_block.data_blocks + (size_t)new_block * block_size, 0, block_size);
+        mark_data_bitmap_dirty(new_block);
+        mark_block_dirty(new_block);
+        logical++;
+    }
+    return 0;
+}
+
+// Turns [offset, offset + len) into a hole: whole blocks are released, the partial
+// ones at the edges are zeroed
+static int punch_range(inode *in, off_t offset, off_t len) {
+    off_t end = offset + len;
+    if (end > in->size) {
+        end = in->size; // За концом файла и так дырка
+    }
+    if (offset >= end) {
+        return 0;
+    }
+    if (in->data_inline) {
+        memset(in->inline_data + offset, 0, end - offset);
+        return 0;
+    }
+    uint32_t first = (uint32_t)((offset + block_size - 1) / block_size);
+    uint32_t last = (uint32_t)(end / block_size); // First block not covered whole
+    int err = zero_in_block(in, offset, first > last ? end : (off_t)first * block_size);
+    if (err == 0 && first < last) {
+        trim_prealloc(in);
+        err = extent_punch(in, first, last - first, release_block);
+    }
+    if (err == 0 && first <= last) {
+        err = zero_in_block(in, (off_t)last * block_size > offset ? (off_t)last * block_size : offset, end);
+    }
+    return err;
+}
+
+static int do_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+    printf("sfs_fallocate: %s mode 0x%x, offset %lld, length %lld\n", path, mode, (long long)offset, (long long)len);
+
+    filetype *file = fi != NULL && fi->fh != 0 ? (filetype *)fi->fh : filetype_from_path(path);
+    if (file == NULL || file->inum == NULL) {
+        return -ENOENT;
+    }
+    if (file->type == NODE_DIRECTORY) {
+        return -EISDIR;
+    }
+    if (file->frozen) {
+        return -EROFS;
+    }
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    if ((unsigned long long)offset + len > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+
+    inode *in = file->inum;
+    int err = delalloc_flush_node(file); // Буферизованные блоки должны получить места до разметки
+    if (err != 0) {
+        commit_dirty_state();
+        return err;
+    }
+    if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        err = punch_range(in, offset, len);
+    } else if (mode == 0 || mode == FALLOC_FL_KEEP_SIZE) {
+        err = preallocate_range(in, offset, len);
+        if (err == 0 && mode == 0 && offset + len > in->size) {
+            in->size = offset + len;
+        }
+    } else {
+        return -EOPNOTSUPP; // Как и в Linux, пробивать дырку можно только с KEEP_SIZE
+    }
+
+    time_t now = time(NULL);
+    in->m_time = now;
+    in->c_time = now;
+    if (journal_log_inode(JR_TRUNCATE, path, in) != 0) {
+        require_checkpoint();
+    }
+    mark_inode_logged(file);
+    commit_dirty_state();
+    return err;
+}
+
+void *sfs_init(struct fuse_conn_info *conn) {
+    (void) conn;
+    start_flusher();
+    return NULL;
+}
+
+// Buffered blocks left without space are reported as ENOSPC, any other commit failure as EIO
+static int commit_error(int ret) {
+    return ret == 0 ? 0 : ret == -ENOSPC ? -ENOSPC : -EIO;
+}
+
+// close(): in write-back mode the data stays dirty until the flusher or an fsync commits it
+static int do_flush(const char *path, struct fuse_file_info *fi) {
+    (void) path;
+    (void) fi;
+    return commit_error(commit_dirty_state());
+}
+
+static int do_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) datasync; // Metadata and data are committed together
+    filetype *node = fi != NULL && fi->fh != 0 ? (filetype *)fi->fh : filetype_from_path(path);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    return commit_error(commit_node(node));
+}
+
+static int do_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) datasync;
+    (void) fi;
+    filetype *dir = filetype_from_path(path);
+    if (dir == NULL) {
+        return -ENOENT;
+    }
+    return commit_error(commit_node(dir));
+}
+
+// Every handler runs under fs_lock, FUSE calls them from several threads
+// and the flusher thread commits in between.
+int sfs_mkdir(const char *path, mode_t mode) {
+    fs_lock();
+    int ret = do_mkdir(path, mode);
+    if (ret == 0 && snapshot_name(path) != NULL) {
+        dcache_invalidate_prefix(path); // A new snapshot brings a whole tree, misses below it are stale
+    } else if (ret == 0) {
+        dcache_invalidate(path); // A cached miss for the new name
+    }
+    fs_unlock();
+    return ret;
+}
+
+int sfs_getattr(const char *path, struct stat *stat_buf) {
+    fs_lock();
+    int ret = do_getattr(path, stat_buf);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    fs_lock();
+    int ret = do_readdir(path, buffer, filler, offset, fi);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    fs_lock();
+    int ret = do_create(path, mode, fi);
+    if (ret == 0) {
+        dcache_invalidate(path);
+    }
+    fs_unlock();
+    return ret;
+}
+
+int sfs_rmdir(const char *path) {
+    fs_lock();
+    int ret = do_rmdir(path);
+    if (ret == 0) {
+        dcache_invalidate_prefix(path); // Misses cached below the directory
+    }
+    fs_unlock();
+    return ret;
+}
+
+int sfs_rm(const char *path) {
+    fs_lock();
+    int ret = do_rm(path);
+    if (ret == 0) {
+        dcache_invalidate(path);
+    }
+    fs_unlock();
+    return ret;
+}
+
+int sfs_open(const char *path, struct fuse_file_info *fi) {
+    fs_lock();
+    int ret = do_open(path, fi);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    fs_lock();
+    int ret = do_read(path, buf, size, offset, fi);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    fs_lock();
+    int ret = do_write(path, buf, size, offset, fi);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_release(const char *path, struct fuse_file_info *fi) {
+    fs_lock();
+    int ret = do_release(path, fi);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_rename(const char *from, const char *to) {
+    fs_lock();
+    int ret = do_rename(from, to);
+    if (ret == 0) {
+        // Paths under the old name lead nowhere now, misses under the new one are wrong
+        dcache_invalidate_prefix(from);
+        dcache_invalidate_prefix(to);
+    }
+    fs_unlock();
+    return ret;
+}
+
+int sfs_utimens(const char *path, const struct timespec tv[2]) {
+    fs_lock();
+    int ret = do_utimens(path, tv);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_truncate(const char *path, off_t size) {
+    fs_lock();
+    int ret = do_truncate(path, size);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_flush(const char *path, struct fuse_file_info *fi) {
+    fs_lock();
+    int ret = do_flush(path, fi);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    fs_lock();
+    int ret = do_fsync(path, datasync, fi);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    fs_lock();
+    int ret = do_fsyncdir(path, datasync, fi);
+    fs_unlock();
+    return ret;
+}
+
+int sfs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+    fs_lock();
+    int ret = do_fallocate(path, mode, offset, len, fi);
+    fs_unlock();
+    return ret;
+}
@@ -0,0 +1,47 @@
+#include "../include/operations.h"
+#include "../include/options.h"
+#include <stddef.h>
+#include <fuse/fuse_opt.h>
+
+mount_options options = {
+    .writeback = 0,
+    .commit_interval = DEFAULT_COMMIT_INTERVAL,
+    .dirty_limit = DEFAULT_DIRTY_LIMIT,
+    .atime = ATIME_RELATIME,
+    .evict_age = DEFAULT_EVICT_AGE,
+    .dcache_size = DEFAULT_DCACHE_SIZE,
+};
+
+static const char *atime_names[] = { "strictatime", "relatime", "noatime", "lazyatime" };
+
+// SFS specific -o options, everything else is passed on to FUSE
+static const struct fuse_opt option_spec[] = {
+    { "writeback", offsetof(mount_options, writeback), 1 },
+    { "commit_interval=%d", offsetof(mount_options, commit_interval), 0 },
+    { "dirty_limit=%ld", offsetof(mount_options, dirty_limit), 0 },
+    { "strictatime", offsetof(mount_options, atime), ATIME_STRICT },
+    { "relatime", offsetof(mount_options, atime), ATIME_RELATIME },
+    { "noatime", offsetof(mount_options, atime), ATIME_NOATIME },
+    { "lazyatime", offsetof(mount_options, atime), ATIME_LAZY },
+    { "evict_age=%d", offsetof(mount_options, evict_age), 0 },
+    { "dcache_size=%d", offsetof(mount_options, dcache_size), 0 },
+    FUSE_OPT_END
+};
+
+int parse_mount_options(struct fuse_args *args) {
+    if (fuse_opt_parse(args, &options, option_spec, NULL) == -1) {
+        return -1;
+    }
+    if (options.commit_interval <= 0) {
+        printf("SFS: commit_interval must be positive, using %d\n", DEFAULT_COMMIT_INTERVAL);
+        options.commit_interval = DEFAULT_COMMIT_INTERVAL;
+    }
+    if (options.dirty_limit <= 0) {
+        printf("SFS: dirty_limit must be positive, using %d\n", DEFAULT_DIRTY_LIMIT);
+        options.dirty_limit = DEFAULT_DIRTY_LIMIT;
+    }
+    printf("SFS: %s mode, commit interval %ds, dirty limit %ld bytes, %s\n",
+           options.writeback ? "write-back" : "synchronous", options.commit_interval, options.dirty_limit,
+           atime_names[options.atime]);
+    return 0;
+}
@@ -14,10 +14,17 @@
 #include "../include/fs_init.h"
 #include "../include/operations.h"
 
+// ./shell -f -o writeback,commit_interval=5,dirty_limit=262144 /home/alexander/mnt
 int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (parse_mount_options(&args) != 0) {
+        return 1;
+    }
+
     restore_file_system();
 
-    int ret = fuse_main(argc, argv, &operations, NULL);
+    int ret = fuse_main(args.argc, args.argv, &operations, NULL);
+    fuse_opt_free_args(&args);
 
 
     root = NULL;
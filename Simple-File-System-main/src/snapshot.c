@@ -0,0 +1,140 @@
+#include "../include/fs_init.h"
+#include "../include/snapshot.h"
+#include <errno.h>
+
+// Synthetic directory, never stored in the image and not listed among root's children
+static filetype *snapshot_dir = NULL;
+
+filetype *snapshot_directory() {
+    if (snapshot_dir != NULL) {
+        return snapshot_dir;
+    }
+    snapshot_dir = calloc(1, sizeof(filetype));
+    inode *in = calloc(1, sizeof(inode));
+    if (snapshot_dir == NULL || in == NULL) {
+        perror("Failed to allocate snapshot directory");
+        free(snapshot_dir);
+        free(in);
+        snapshot_dir = NULL;
+        return NULL;
+    }
+    if (node_set_name(snapshot_dir, SNAPSHOT_DIR_NAME, strlen(SNAPSHOT_DIR_NAME)) != 0) {
+        free(snapshot_dir);
+        free(in);
+        snapshot_dir = NULL;
+        return NULL;
+    }
+    snapshot_dir->type = NODE_DIRECTORY;
+    snapshot_dir->valid = 1;
+    snapshot_dir->num_links = 2;
+    snapshot_dir->frozen = 1;
+    snapshot_dir->parent = root;
+    in->permissions = S_IFDIR | 0555;
+    in->user_id = root->inum->user_id;
+    in->group_id = root->inum->group_id;
+    in->a_time = in->m_time = in->c_time = in->b_time = time(NULL);
+    snapshot_dir->inum = in;
+    return snapshot_dir;
+}
+
+// "/.snapshots" and everything below it is read-only
+int is_snapshot_path(const char *path) {
+    size_t len = strlen(SNAPSHOT_DIR_NAME);
+    return path[0] == '/' && strncmp(path + 1, SNAPSHOT_DIR_NAME, len) == 0 &&
+           (path[len + 1] == '\0' || path[len + 1] == '/');
+}
+
+static int attach_snapshot(filetype *dir, int slot) {
+    int orphans = 0;
+    filetype *tree = image_load_snapshot(slot, &orphans);
+    if (tree == NULL) {
+        printf("SFS: snapshot slot %d has no root directory\n", slot);
+        return -1;
+    }
+    if (orphans > 0) {
+        printf("SFS: snapshot %s has %d unreachable entries\n", image_snapshot(slot)->name, orphans);
+    }
+    const char *name = image_snapshot(slot)->name;
+    if (node_set_name(tree, name, strlen(name)) != 0) {
+        free_filetype(tree);
+        return -1;
+    }
+    tree->parent = dir;
+    add_child(dir, tree);
+    return 0;
+}
+
+// Reads the snapshot roots on the first lookup of /.snapshots
+int load_snapshots(filetype *dir) {
+    for (int slot = 0; slot < (int)image->snapshot_slots; slot++) {
+        if (image_snapshot(slot)->in_use && attach_snapshot(dir, slot) != 0) {
+            return -1;
+        }
+    }
+    dir->children_loaded = 1;
+    return 0;
+}
+
+// The snapshot copies the inode table as it is on disk, so everything dirty is committed first
+int snapshot_create(const char *name) {
+    if (flush_dirty_state() != 0) {
+        return -EIO;
+    }
+    int slot = image_create_snapshot(name);
+    if (slot < 0) {
+        return slot;
+    }
+    printf("SFS: created snapshot %s in slot %d\n", name, slot);
+
+    filetype *dir = snapshot_directory();
+    if (dir != NULL && dir->children_loaded) {
+        attach_snapshot(dir, slot);
+    }
+    return 0;
+}
+
+static int subtree_open(const filetype *node) {
+    if (node->open_count > 0) {
+        return 1;
+    }
+    for (int i = 0; i < node->num_children; i++) {
+        if (subtree_open(node->children[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int snapshot_delete(const char *name) {
+    int slot = image_find_snapshot(name);
+    if (slot < 0) {
+        return -ENOENT;
+    }
+    filetype *dir = snapshot_directory();
+    for (int i = 0; dir != NULL && i < dir->num_children; i++) {
+        filetype *tree = dir->children[i];
+        if (strcmp(node_name(tree), name) != 0) {
+            continue;
+        }
+        if (subtree_open(tree)) {
+            return -EBUSY;
+        }
+        remove_child(dir, tree);
+        free_filetype(tree);
+        break;
+    }
+    // Blocks released here may be pending in the live dirty ranges, commit those first
+    if (flush_dirty_state() != 0) {
+        return -EIO;
+    }
+    int res = image_delete_snapshot(slot);
+    if (res == 0) {
+        printf("SFS: deleted snapshot %s\n", name);
+    }
+    return res;
+}
+
+void close_snapshots() {
+    free_filetype(snapshot_dir);
+    snapshot_dir = NULL;
+}
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Unlink, create, flush, remount in write-back mode. The new file takes the inode
+# number the removed one just released, within the same commit window, and must
+# still be there after the remount.
+# Usage: tests/inode_reuse.sh [mkfs.sfs] [shell] [fsch], run from the makefile directory
+set -e
+
+MKFS=$(realpath "${1:-../bin/mkfs.sfs}")
+SHELL_BIN=$(realpath "${2:-build/release/shell}")
+FSCH=$(realpath "${3:-../bin/fsch}")
+
+WORK=$(mktemp -d)
+MNT="$WORK/mnt"
+PID=
+cleanup() {
+    fusermount -u "$MNT" 2>/dev/null || true
+    [ -n "$PID" ] && wait "$PID" 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+mount_sfs() {
+    (cd "$WORK" && exec "$SHELL_BIN" -f -o writeback,commit_interval=3600 "$MNT") >"$WORK/shell.log" 2>&1 &
+    PID=$!
+    for _ in $(seq 50); do
+        mountpoint -q "$MNT" && return 0
+        sleep 0.1
+    done
+    echo "mount failed" >&2
+    exit 1
+}
+
+umount_sfs() {
+    fusermount -u "$MNT"
+    wait "$PID"
+    PID=
+}
+
+mkdir "$MNT"
+(cd "$WORK" && "$MKFS" . >/dev/null)
+
+mount_sfs
+echo old > "$MNT/x"
+sync "$MNT/x"
+rm "$MNT/x"
+echo new > "$MNT/y"
+sync "$MNT/y"
+umount_sfs
+
+mount_sfs
+[ "$(cat "$MNT/y")" = new ] || { echo "FAIL: /y lost after remount" >&2; exit 1; }
+[ ! -e "$MNT/x" ] || { echo "FAIL: /x came back" >&2; exit 1; }
+umount_sfs
+
+(cd "$WORK" && "$FSCH" .) | grep -q "Filesystem is healthy" || { echo "FAIL: fsch" >&2; exit 1; }
+echo "inode_reuse: OK"
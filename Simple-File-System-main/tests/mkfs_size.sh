@@ -0,0 +1,26 @@
+#!/bin/sh
+# mkfs.sfs must refuse a size whose suffix pushes it past 64 bits instead of
+# wrapping around to a small image, and still accept the largest sizes that fit.
+# Usage: tests/mkfs_size.sh [mkfs.sfs], run from the makefile directory
+set -e
+
+MKFS=$(realpath "${1:-../bin/mkfs.sfs}")
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# 2^34 G is 2^64 bytes, it wraps to 0 without the check
+for size in 17179869184G 18014398509481984M 18446744073709551616 99999999999999999999K; do
+    if "$MKFS" -s "$size" "$WORK" >"$WORK/out.log" 2>&1; then
+        echo "FAIL: -s $size was accepted"
+        exit 1
+    fi
+    if [ -e "$WORK/sfs.img" ]; then
+        echo "FAIL: -s $size created an image"
+        exit 1
+    fi
+done
+
+"$MKFS" -s 1M -i 64 "$WORK" >"$WORK/out.log" 2>&1 || { echo "FAIL: -s 1M was refused"; cat "$WORK/out.log"; exit 1; }
+[ -e "$WORK/sfs.img" ] || { echo "FAIL: -s 1M created no image"; exit 1; }
+echo "mkfs_size: OK"
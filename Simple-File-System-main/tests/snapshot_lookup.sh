@@ -0,0 +1,42 @@
+#!/bin/sh
+# Looks up a path inside a snapshot before the snapshot exists, creates it and looks
+# again. The miss cached by the first lookup must not hide the new snapshot tree,
+# and after the snapshot is deleted the path must be gone again.
+# Usage: tests/snapshot_lookup.sh [mkfs.sfs] [shell], run from the makefile directory
+set -e
+
+MKFS=$(realpath "${1:-../bin/mkfs.sfs}")
+SHELL_BIN=$(realpath "${2:-build/release/shell}")
+
+WORK=$(mktemp -d)
+MNT="$WORK/mnt"
+PID=
+cleanup() {
+    fusermount -u "$MNT" 2>/dev/null || true
+    [ -n "$PID" ] && wait "$PID" 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+mkdir "$MNT"
+(cd "$WORK" && "$MKFS" . >/dev/null)
+(cd "$WORK" && exec "$SHELL_BIN" -f "$MNT") >"$WORK/shell.log" 2>&1 &
+PID=$!
+for _ in $(seq 50); do
+    mountpoint -q "$MNT" && break
+    sleep 0.1
+done
+mountpoint -q "$MNT" || { echo "mount failed" >&2; exit 1; }
+
+mkdir "$MNT/a"
+echo data > "$MNT/a/b"
+[ ! -e "$MNT/.snapshots/s1/a/b" ] || { echo "FAIL: snapshot path before the snapshot" >&2; exit 1; }
+mkdir "$MNT/.snapshots/s1"
+[ "$(cat "$MNT/.snapshots/s1/a/b")" = data ] || { echo "FAIL: stale miss hides the snapshot" >&2; exit 1; }
+rmdir "$MNT/.snapshots/s1"
+[ ! -e "$MNT/.snapshots/s1/a/b" ] || { echo "FAIL: deleted snapshot still visible" >&2; exit 1; }
+
+fusermount -u "$MNT"
+wait "$PID"
+PID=
+echo "snapshot_lookup: OK"
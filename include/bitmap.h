@@ -0,0 +1,26 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Bit-packed allocation bitmaps: bit i of word i / 64 is set when slot i is in use.
+// Shared by mkfs.sfs, fsch and the FUSE layer, stored as is in the superblock slots.
+
+#define BITMAP_WORD_BITS 64
+
+size_t bitmap_bytes(size_t bits);
+
+int bitmap_test(const uint64_t *map, size_t bit);
+
+void bitmap_set(uint64_t *map, size_t bit);
+
+void bitmap_clear(uint64_t *map, size_t bit);
+
+long bitmap_find_free(const uint64_t *map, size_t bits, size_t first, size_t hint);
+
+size_t bitmap_free_run(const uint64_t *map, size_t bits, size_t bit, size_t max);
+
+size_t bitmap_count(const uint64_t *map, size_t bits);
+
+#endif
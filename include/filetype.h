@@ -7,26 +7,88 @@
 #include "../include/inode.h"
 #include "../include/fs_init.h"
 
-#define MAX_FILES 31
-
 typedef struct inode inode;
 
+typedef enum node_type {
+    NODE_NONE = 0,
+    NODE_FILE,
+    NODE_DIRECTORY
+} node_type;
+
+#define CHILD_HASH_MIN 8         // Buckets of a directory's name index when its first entry arrives
+
+// readdir offsets. An entry's cookie is its name hash shifted past a collision number,
+// so it does not move when other entries come and go; 1 and 2 are "." and "..".
+#define DIR_COOKIE_FIRST 3
+#define DIR_COOKIE_MINOR_BITS 30
+#define DIR_COOKIE_LAST (((int64_t)1 << 62) + DIR_COOKIE_FIRST) // After every entry cookie
+
+// The fields a path lookup reads come first and share one cache line, the name is
+// kept in the name arena (node_set_name) and the rest is only touched by the
+// operation that works on the node itself. A node does not store its path, it
+// follows from the parent pointers (node_full_path), so a rename touches one node.
+// Every directory indexes its entries by name: child_hash is a power-of-two bucket
+// array chained through hash_next, grown by add_child and rebuilt from the children
+// array, so a lookup costs the same in any directory size. It is never stored, a
+// loaded directory builds it as its entries are attached.
+// The same entries are also kept in cookie order in an AVL tree threaded through
+// order_left/order_right, which readdir walks and resumes from any offset. The
+// children array itself is unordered, an entry knows its slot and leaves in O(1).
 typedef struct filetype {
-    int valid;                   // Flag indicating if the filetype is valid
-    char path[100];              // Path of the filetype
-    char name[100];              // Name of the filetype
+    struct filetype **child_hash; // Name index of the entries, NULL until the first one
+    struct filetype *hash_next;  // Next entry in the same bucket of the parent's index
+    uint32_t name_ref;           // Name of the filetype in the name arena, see node_name
+    uint32_t name_len;           // Its length
+    uint32_t name_hash;          // Hash of name, set by node_set_name
+    node_type type;              // Type of the filetype
+    uint32_t child_hash_mask;    // Buckets - 1
+    int children_loaded;         // Entries have been read from the image
+    struct filetype *parent;     // Pointer to the parent filetype
     inode *inum;                 // Pointer to the inode associated with the filetype
     struct filetype **children;  // Array of pointers to child filetypes
     int num_children;            // Number of child filetypes
+    int child_slot;              // Index of the node in its parent's children array
+    struct filetype *order_root; // Entries in cookie order, NULL for an empty directory
+    struct filetype *order_left; // Entries of the parent with a smaller cookie
+    struct filetype *order_right; // Entries of the parent with a larger cookie
+    int order_height;            // Height of the subtree under this node, 1 for a leaf
+    int64_t cookie;              // readdir offset of the entry, set by child_index_add
+    int valid;                   // Flag indicating if the filetype is valid
     int num_links;               // Number of links to the filetype
-    struct filetype *parent;     // Pointer to the parent filetype
-    char type[20];               // Type of the filetype
+    unsigned dirty_gen;          // Flush generation in which the inode was marked dirty
+    int frozen;                  // Part of a read-only snapshot
 } filetype;
 
+// Result of resolve_path. name is the last component of the resolved path, not
+// terminated, so callers split a path without copying it.
+typedef struct path_lookup {
+    filetype *parent;            // Directory that holds the last component, NULL for "/"
+    filetype *node;              // The entry itself, NULL if the directory has no such name
+    const char *name;            // Last component, points into the path
+    size_t name_len;             // Its length without trailing slashes
+} path_lookup;
+
 extern char *strdup(const char *s);
 extern filetype *root;
-extern filetype file_array[MAX_FILES];
+
+int resolve_path(const char *path, path_lookup *res);
 
 filetype *filetype_from_path(const char *path);
 
+int node_set_name(filetype *node, const char *name, size_t len);
+
+const char *node_name(const filetype *node);
+
+const char *node_type_name(node_type type);
+
+filetype *find_child(const filetype *dir, const char *name, size_t len);
+
+filetype *next_child(const filetype *dir, int64_t cookie);
+
+void child_index_add(filetype *dir, filetype *child);
+
+void child_index_remove(filetype *dir, filetype *child);
+
+void remove_child(filetype *parent, filetype *child);
+
 #endif
@@ -4,26 +4,37 @@
 #include "../include/inode.h"
 #include "../include/superblock.h"
 #include "../include/filetype.h"
+#include "../include/names.h"
 #include "../include/utilities.h"
+#include "../include/journal.h"
+#include "../include/image.h"
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <time.h>
 
+#ifndef S_IFDIR
 #define S_IFDIR 0x4000
+#endif
+#ifndef PATH_MAX
 #define PATH_MAX 200
+#endif
 
 
-extern char file_struct_path_global[256];
-extern char super_path_global[256];
+extern char image_path_global[256];
+extern char journal_path_global[256];
 
 void root_dir_init();
 
 int save_system_state();
 
-void restore_file_system(const char *super_path, const char *file_struct_path);
+void restore_file_system(const char *image_path, const char *journal_path, const image_geometry *geometry);
 
-void set_fs_paths(const char *super_path, const char *file_struct_path);
+void set_fs_paths(const char *image_path, const char *journal_path);
+
+void load_file_structure();
+
+void format_file_system(const char *image_path, const char *journal_path, const image_geometry *geometry);
 
 bool ask_for_format_confirmation();
 
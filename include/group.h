@@ -0,0 +1,50 @@
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Allocation groups: the data area and the inode numbers are cut into the same number
+// of slices, group g of inodes going with group g of blocks. Each group searches only
+// its own words of the shared bitmaps and keeps its own hints, free counters and lock,
+// so allocations in different groups touch different cache lines. The FUSE handlers
+// still call the allocator under the global fs_lock, so today the groups give locality
+// of placement, not parallel allocation. Groups follow from the geometry and are not
+// stored in the image.
+
+#define GROUP_ALIGN_BITS 512   // Bitmap bits per cache line, groups start on one
+#define GROUP_CACHE_LINE 64
+
+typedef struct alloc_group {
+    _Alignas(GROUP_CACHE_LINE) pthread_mutex_t lock;
+    uint32_t first_block;   // Data blocks [first_block, first_block + num_blocks)
+    uint32_t num_blocks;
+    uint32_t first_inode;   // Inode numbers [first_inode, first_inode + num_inodes)
+    uint32_t num_inodes;
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t reserved_blocks; // Free blocks held for preallocation (see superblock.c)
+    uint64_t *reserved_map; // Bit per block of the group, set while reserved
+    uint32_t block_hint;    // Next-fit position, relative to first_block
+    uint32_t inode_hint;    // Relative to first_inode
+    uint32_t *free_list;    // Inode numbers released since the mount, reused first (see inode.c)
+    uint32_t free_list_len;
+    uint32_t free_list_capacity;
+} alloc_group;
+
+extern alloc_group *groups;
+extern int num_groups;
+
+int groups_init();
+
+void groups_recount();
+
+void groups_close();
+
+int group_of_block(int block);
+
+int group_of_inode(int number);
+
+int group_goal_block(int number);
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "../include/superblock.h"
+#include "../include/filetype.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define IMAGE_MAGIC 0x31534653u        // "SFS1"
+#define IMAGE_VERSION 9
+#define IMAGE_HEADER_SIZE 4096
+#define SUPERBLOCK_SLOTS 2             // Each slot starts on its own page, a torn write damages only one
+#define SUPERBLOCK_CHUNK_SIZE 4096     // Unit of the slot payload that is checksummed and rewritten on its own
+#define SUPERBLOCK_SLOT_HEADER_SIZE 16 // Packed superblock_slot at the start of each slot
+
+#define MAX_SNAPSHOTS 8                // Most snapshot slots mkfs.sfs creates by default
+#define SNAPSHOT_SPACE_SHARE 4         // Default slots take at most this fraction of the data area
+#define SNAPSHOT_NAME_LEN 64
+#define SNAPSHOT_BITMAP_OFFSET 256     // Inside a slot: header | inode bitmap | inode table | dirents
+
+// Limits accepted by mkfs.sfs and image_open
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define MAX_BLOCK_COUNT (1u << 30)     // Block numbers are signed 32-bit, the slot length must fit 32 bits
+#define MIN_INODE_COUNT 3              // 0 and 1 are reserved, 2 is the root
+#define MAX_INODE_COUNT (1u << 24)
+
+// Layout of sfs.img:
+//   header | superblock slot 0 | superblock slot 1 | inode table | dirent area | snapshots | data blocks
+// The bitmaps and reference counts change on almost every operation. They are kept
+// in memory and committed to the older of the two superblock slots with the next
+// sequence number and a checksum, so the previous slot stays intact until the new
+// one is on disk. The payload is split into chunks with one checksum each, a commit
+// rewrites only the chunks that changed since that slot was last written. Opening
+// the image picks the newest slot whose header and chunks all match their checksums.
+// Inode n lives at inode_table_offset + n * INODE_RECORD_SIZE, its name and parent
+// at dirent_offset + n * DIRENT_RECORD_SIZE. Any inode can be read or rewritten
+// in place without touching the rest, the tree is rebuilt from the parent numbers.
+// A snapshot slot holds a frozen copy of the inode bitmap, the inode table and the
+// dirent area. Data blocks are shared, refcounts[b] counts the live tree and every
+// snapshot referencing block b, a write to a shared block copies it first.
+// Block size, block count and inode count are chosen by mkfs.sfs and every region
+// is sized from them, nothing but the limits above is compiled in.
+// The header and the superblock slots (slot header, chunk checksums, bitmap words) are
+// stored little-endian at fixed offsets by pack_image_header and pack_superblock_slot,
+// image_header and superblock_slot are only the in-memory copies.
+typedef struct image_header {
+    uint32_t magic;                // IMAGE_MAGIC
+    uint32_t version;              // IMAGE_VERSION
+    uint32_t data_block_size;      // Size of one data block
+    uint32_t block_count;          // Number of data blocks
+    uint64_t superblock_offset;    // Offset of the first superblock slot
+    uint64_t superblock_slot_size; // Page aligned, holds the bitmaps and the reference counts
+    uint32_t superblock_slots;     // SUPERBLOCK_SLOTS
+    uint64_t inode_table_offset;   // Offset of the inode table
+    uint64_t dirent_offset;        // Offset of the directory entry area
+    uint32_t inode_count;          // Records in the inode table and the dirent area
+    uint32_t inode_record_size;    // INODE_RECORD_SIZE
+    uint32_t dirent_record_size;   // DIRENT_RECORD_SIZE
+    uint32_t root_inode;           // Inode number of the root directory
+    uint64_t snapshot_offset;      // Offset of the first snapshot slot
+    uint32_t snapshot_slots;       // Number of snapshot slots, may be 0
+    uint64_t snapshot_slot_size;   // Page aligned size of one snapshot slot
+    uint64_t data_offset;          // Offset of the first data block
+    uint64_t image_size;           // Total size of the image file
+} image_header;
+
+// Followed by one CRC32 (le32) per SUPERBLOCK_CHUNK_SIZE bytes of payload and, from the
+// next chunk boundary, the payload: the data bitmap (block_count bits), the inode bitmap
+// (inode_count bits), both as le64 words, and the reference counts (one byte per block)
+typedef struct superblock_slot {
+    uint64_t sequence;             // Commit number, 0 for a slot that was never written
+    uint32_t checksum;             // CRC32 of the packed header, with this field set to 0, and of the chunk CRCs
+    uint32_t length;               // Payload bytes
+} superblock_slot;
+
+typedef struct snapshot_header {
+    uint32_t in_use;               // Set only after the copy and its block references reached the disk
+    uint32_t inode_count;          // Records in the frozen table
+    uint64_t created;              // Creation time
+    char name[SNAPSHOT_NAME_LEN];
+} snapshot_header;
+
+extern image_header *image;
+
+void image_default_geometry(image_geometry *geometry);
+
+// Bytes one snapshot slot takes in an image of this geometry
+uint64_t image_snapshot_slot_size(const image_geometry *geometry);
+
+uint32_t image_default_snapshot_slots(const image_geometry *geometry);
+
+int image_check_geometry(const image_geometry *geometry);
+
+int image_create(const char *path, const image_geometry *geometry);
+
+int image_open(const char *path, int writable);
+
+void image_close();
+
+char *image_inode(int number);
+
+char *image_dirent(int number);
+
+int image_store_extents(inode *in);
+
+int image_store_node(filetype *node);
+
+int image_clear_node(int number);
+
+filetype *image_load_root();
+
+int image_load_children(filetype *dir);
+
+filetype *image_load_tree(int *orphans);
+
+int image_write_tree(filetype *tree);
+
+snapshot_header *image_snapshot(int slot);
+
+int image_find_snapshot(const char *name);
+
+filetype *image_load_snapshot(int slot, int *orphans);
+
+int image_create_snapshot(const char *name);
+
+int image_delete_snapshot(int slot);
+
+void image_count_refs(unsigned char *counts);
+
+int image_rebuild_refcounts();
+
+int image_sync(const void *addr, size_t length);
+
+superblock_slot image_superblock(int slot);
+
+int image_superblock_valid(int slot);
+
+uint64_t image_superblock_sequence();
+
+// Called after changing bitmap words or reference counts in s_block, the chunks
+// holding them are rewritten by the next commit of each slot
+void image_superblock_changed(const void *addr, size_t length);
+
+int image_commit_superblock();
+
+#endif
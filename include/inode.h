@@ -3,14 +3,39 @@
 
 #include "superblock.h"
 #include "filetype.h"
+#include "extent.h"
 #include "sys/types.h"
 
+// Files of up to this many bytes keep their contents in the inode record, in the area
+// that otherwise holds the inline runs, and take no data block at all
+#define INODE_INLINE_DATA INODE_BLOCK_AREA
+#define INODE_FLAG_INLINE_DATA 0x1
+
+#define INODE_TABLE_CHUNK 256  // Inodes per chunk of the in-memory inode table
+
 typedef struct filetype filetype;
+typedef struct pending_block pending_block;
 typedef struct inode {
-    int datablocks[16];        // Numbers of data blocks
+    extent *extents;           // Runs of data blocks, sorted by file block (see extent.h)
+    int num_extents;           // Runs in use
+    int extent_capacity;       // Runs allocated
+    int extent_block;          // Root of the extent tree once the runs outgrow the record, 0 if none
+    int extent_depth;          // Levels of that tree, 0 while the runs are inline
+    int extent_hint;           // Run found by the last lookup, sequential access skips the search
+    int extents_dirty;         // Runs changed since the record was stored
+    int prealloc_start;        // Blocks reserved ahead of sequential appends, in memory only
+    int prealloc_len;
+    uint32_t prealloc_next;    // File block the reservation continues
+    int prealloc_window;       // Reservation size, doubles with every sequential append
+    pending_block *pending;    // Written file blocks still waiting for a data block, sorted
+    int num_pending;           // (delayed allocation in the FUSE layer, in memory only)
+    int pending_capacity;
+    int data_inline;           // Contents live in inline_data, the file has no runs
+    char inline_data[INODE_INLINE_DATA]; // Zero past the end of the file
     int number;                // Inode number
+    int table_slot;            // Lives in the inode table below, not in its own allocation
     int blocks;                // Number of data blocks
-    int size;                  // Size of the file/directory
+    off_t size;                // Size of the file/directory
     mode_t permissions;        // Access permissions
     uid_t user_id;             // User identifier
     gid_t group_id;            // Group identifier
@@ -20,8 +45,26 @@ typedef struct inode {
     time_t b_time;             // Creation time
 } inode;
 
+// The inodes of the live tree sit in one table indexed by inode number. It is cut
+// into chunks allocated on first use, so it grows with the inodes actually loaded
+// and a chunk never moves: filetype->inum points straight into it. Snapshot trees
+// have their own numbering and keep separately allocated inodes.
+inode *inode_table_get(int number);
+
+inode *inode_table_lookup(int number);
+
+inode *inode_table_next(int *number);
+
+void inode_free(inode *in);
+
+void inode_table_close();
+
 int find_free_inode();
 
+int find_free_inode_near(int parent, int directory);
+
+void release_inode_number(int number);
+
 void add_child(filetype *parent, filetype *child);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,61 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "../include/utilities.h"
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x4A534653u             // "SFSJ"
+#define JOURNAL_CHECKPOINT_BYTES (64 * 1024)  // Journal size that triggers a checkpoint
+#define JOURNAL_PATH_LEN 256
+
+// Metadata record types
+#define JR_MKDIR    1  // path, inode
+#define JR_CREATE   2  // path, inode
+#define JR_UNLINK   3  // path
+#define JR_RMDIR    4  // path
+#define JR_RENAME   5  // from, to
+#define JR_TRUNCATE 6  // path, inode after truncate or fallocate
+#define JR_INODE    7  // path, inode of a node not yet checkpointed
+
+typedef struct journal_header {
+    uint32_t magic;     // JOURNAL_MAGIC
+    uint32_t type;      // Record type (JR_*)
+    uint64_t seq;       // Sequence number, starts at 1 after every checkpoint
+    uint32_t length;    // Payload length in bytes
+    uint32_t checksum;  // CRC32 of the header (checksum = 0) and the payload
+} journal_header;
+
+typedef struct journal_info {
+    int records;        // Valid records found
+    int applied;        // Records that changed the in-memory tree
+    long valid_bytes;   // Length of the valid prefix
+    long total_bytes;   // Journal file size
+} journal_info;
+
+int journal_open(const char *path);
+
+void journal_close();
+
+// The log functions return -ENAMETOOLONG for a path of JOURNAL_PATH_LEN bytes or more,
+// -1 when the record could not be written
+int journal_check_path(const char *path);
+
+int journal_log_path(uint32_t type, const char *path);
+
+int journal_log_rename(const char *from, const char *to);
+
+int journal_log_inode(uint32_t type, const char *path, const inode *i);
+
+int journal_sync();
+
+int journal_pending();
+
+long journal_size();
+
+int journal_reset();
+
+int journal_replay(const char *path, journal_info *info);
+
+int node_full_path(const filetype *node, char *buf, size_t len);
+
+#endif
@@ -2,17 +2,40 @@
 #define UTILITIES_H
 
 #include "../include/filetype.h"
+#include "../include/extent.h"
+#include <stdint.h>
 
 typedef struct filetype filetype;
 typedef struct inode inode;
+typedef struct image_header image_header;
+typedef struct superblock_slot superblock_slot;
 
-void deserialize_filetype_from_file(filetype *f, FILE *fp);
-void serialize_filetype_to_file(filetype *f, FILE *fp);
-void deserialize_inode_from_file(inode *i, FILE *fp);
-void serialize_inode_to_file(inode *i, FILE *fp);
-void serialize_superblock_to_file(superblock *sb, FILE *fp);
-void deserialize_superblock_from_file(superblock *sb, FILE *fp);
-char* get_file_name(const char* path);
-char* get_file_path(const char* path);
+// Fixed-size on-disk records, both indexed by inode number
+#define INODE_RECORD_SIZE 256
+#define DIRENT_RECORD_SIZE 128
+#define DIRENT_NAME_LEN (DIRENT_RECORD_SIZE - 16)
+
+#define DIRENT_FILE 1
+#define DIRENT_DIRECTORY 2
+
+void put_le32(char *buf, uint32_t v);
+void put_le64(char *buf, uint64_t v);
+uint32_t get_le32(const char *buf);
+uint64_t get_le64(const char *buf);
+size_t pack_inode(const inode *i, char *buf);
+int unpack_inode(inode *i, const char *buf, const char *runs);
+size_t pack_extents(const inode *i, char *buf);
+void pack_extent_leaf(const inode *i, const extent *runs, int count, char *buf);
+void pack_extent_index(const inode *i, int level, const uint32_t *first, const int *children, int count, char *buf);
+typedef int (*extent_visit)(int block, int level, const char *entries, uint32_t count, void *arg);
+int walk_extent_tree(int root, int depth, int owner, extent_visit visit, void *arg);
+size_t pack_dirent(const filetype *f, char *buf);
+int unpack_dirent(filetype *f, const char *buf, int *parent);
+int peek_dirent(const char *buf, int *parent);
+void pack_image_header(const image_header *h, char *buf);
+void unpack_image_header(image_header *h, const char *buf);
+void pack_superblock_slot(const superblock_slot *s, char *buf);
+void unpack_superblock_slot(superblock_slot *s, const char *buf);
+uint32_t crc32_buf(uint32_t crc, const void *data, size_t len);
 void free_filetype(filetype *node);
 #endif 
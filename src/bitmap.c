@@ -0,0 +1,77 @@
+#include "../include/bitmap.h"
+
+size_t bitmap_bytes(size_t bits) {
+    return (bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS * sizeof(uint64_t);
+}
+
+int bitmap_test(const uint64_t *map, size_t bit) {
+    return (map[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+void bitmap_set(uint64_t *map, size_t bit) {
+    map[bit / BITMAP_WORD_BITS] |= (uint64_t)1 << (bit % BITMAP_WORD_BITS);
+}
+
+void bitmap_clear(uint64_t *map, size_t bit) {
+    map[bit / BITMAP_WORD_BITS] &= ~((uint64_t)1 << (bit % BITMAP_WORD_BITS));
+}
+
+// First clear bit in [from, to), one word per step: full words are skipped whole,
+// the position inside a word comes from count-trailing-zeros of its complement
+static long scan_range(const uint64_t *map, size_t from, size_t to) {
+    while (from < to) {
+        size_t word = from / BITMAP_WORD_BITS;
+        uint64_t free_bits = ~map[word] & (~(uint64_t)0 << (from % BITMAP_WORD_BITS));
+        if (free_bits != 0) {
+            size_t bit = word * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(free_bits);
+            return bit < to ? (long)bit : -1;
+        }
+        from = (word + 1) * BITMAP_WORD_BITS;
+    }
+    return -1;
+}
+
+// Next-fit: searches [hint, bits) and wraps around to [first, hint).
+// Slots below first are reserved and never returned. -1 when the map is full.
+long bitmap_find_free(const uint64_t *map, size_t bits, size_t first, size_t hint) {
+    if (hint < first || hint >= bits) {
+        hint = first;
+    }
+    long bit = scan_range(map, hint, bits);
+    if (bit == -1 && hint > first) {
+        bit = scan_range(map, first, hint);
+    }
+    return bit;
+}
+
+// Length of the run of clear bits that starts at bit, capped at max.
+// Stops at the next set bit, found the same word-wise way as a free one.
+size_t bitmap_free_run(const uint64_t *map, size_t bits, size_t bit, size_t max) {
+    if (bit >= bits) {
+        return 0;
+    }
+    size_t end = bit + max < bits ? bit + max : bits;
+    size_t from = bit;
+    while (from < end) {
+        size_t word = from / BITMAP_WORD_BITS;
+        uint64_t used_bits = map[word] & (~(uint64_t)0 << (from % BITMAP_WORD_BITS));
+        if (used_bits != 0) {
+            size_t used = word * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(used_bits);
+            return (used < end ? used : end) - bit;
+        }
+        from = (word + 1) * BITMAP_WORD_BITS;
+    }
+    return end - bit;
+}
+
+size_t bitmap_count(const uint64_t *map, size_t bits) {
+    size_t count = 0;
+    size_t words = bits / BITMAP_WORD_BITS;
+    for (size_t w = 0; w < words; w++) {
+        count += (size_t)__builtin_popcountll(map[w]);
+    }
+    for (size_t bit = words * BITMAP_WORD_BITS; bit < bits; bit++) {
+        count += (size_t)bitmap_test(map, bit);
+    }
+    return count;
+}
@@ -1,12 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
 #include "../include/fs_init.h"
 #include <unistd.h>
 
 filetype *root;
- char file_struct_path_global[256];
- char super_path_global[256];
+ char image_path_global[256];
+ char journal_path_global[256];
 
 void root_dir_init() {
-    s_block.inode_bitmap[1] = 1; 
+    bitmap_set(s_block.inode_bitmap, 1);
+    image_superblock_changed(s_block.inode_bitmap, sizeof(uint64_t));
 
     root = malloc(sizeof(filetype));
     memset(root, 0, sizeof(filetype));
@@ -15,15 +17,27 @@ void root_dir_init() {
         return; 
     }
 
-    strcpy(root->path, "/");
-    strcpy(root->name, "/");
-    strcpy(root->type, "directory");
+    root->type = NODE_DIRECTORY;
+    if (node_set_name(root, "/", 1) != 0) {
+        free(root);
+        root = NULL;
+        return;
+    }
 
-    root->inum = malloc(sizeof(inode));
-    memset(root->inum, 0, sizeof(inode));
+    int index = find_free_inode();
+    if (index == -1) {
+        perror("Failed to find a free inode");
+        name_release(root->name_ref);
+        free(root);
+        root = NULL;
+        return;
+    }
+    root->inum = inode_table_get(index);
     if (!root->inum) {
         perror("Failed to allocate memory for inode");
+        name_release(root->name_ref);
         free(root);
+        root = NULL;
         return; 
     }
 
@@ -39,19 +53,10 @@ void root_dir_init() {
     root->children = NULL;
     root->parent = NULL;
     root->num_children = 0;
+    root->children_loaded = 1;
     root->num_links = 2;
     root->valid = 1;
     root->inum->size = 0;
-
-    int index = find_free_inode();
-    if (index == -1) {
-        perror("Failed to find a free inode");
-        cleanup_filesystem();
-        free(root->inum);
-        free(root);
-        return;
-    }
-    root->inum->number = index;
     root->inum->blocks = 0;
 
     save_system_state();
@@ -61,44 +66,34 @@ void root_dir_init() {
 
 void print_superblock_details() {
     printf("Data blocks:\n");
-    for (size_t i = 0; i < sizeof(s_block.data_blocks); i++) {
+    for (size_t i = 0; i < (size_t)block_size * BLOCK_COUNT; i++) {
         printf("%c.", s_block.data_blocks[i]);
     }
     printf("\n");
 
     printf("Data Bitmap:\n");
-    for (size_t i = 0; i < sizeof(s_block.data_bitmap); i++) {
-        printf("%c.", s_block.data_bitmap[i]);
+    for (size_t i = 0; i < (size_t)BLOCK_COUNT; i++) {
+        printf("%d.", bitmap_test(s_block.data_bitmap, i));
     }
     printf("\n");
 
     printf("Inode Bitmap:\n");
-    for (size_t i = 0; i < sizeof(s_block.inode_bitmap); i++) {
-        printf("%c.", s_block.inode_bitmap[i]);
+    for (size_t i = 0; i < (size_t)INODE_COUNT; i++) {
+        printf("%d.", bitmap_test(s_block.inode_bitmap, i));
     }
     printf("\n");
 }
 
 
 int save_system_state() {
-    FILE *fd = fopen(file_struct_path_global, "wb");
-    if (!fd) {
-        perror("Failed to open file_structure for writing");
+    if (image_write_tree(root) != 0) {
         return -1;
     }
 
-    serialize_filetype_to_file(root, fd);
-    fclose(fd);
-
-    FILE *fd1 = fopen(super_path_global, "wb");
-    if (!fd1) {
-        perror("Failed to open superblock for writing");
+    if (image_commit_superblock() != 0) {
         return -1;
     }
 
-    serialize_superblock_to_file(&s_block, fd1);
-    fclose(fd1);
-
     return 0;
 }
 
@@ -111,69 +106,81 @@ bool ask_for_format_confirmation() {
 }
 
 
-void set_fs_paths(const char *super_path, const char *file_struct_path) {
-    strncpy(super_path_global, super_path, sizeof(super_path_global) - 1);
-    super_path_global[sizeof(super_path_global) - 1] = '\0';
+void set_fs_paths(const char *image_path, const char *journal_path) {
+    strncpy(image_path_global, image_path, sizeof(image_path_global) - 1);
+    image_path_global[sizeof(image_path_global) - 1] = '\0';
 
-    strncpy(file_struct_path_global, file_struct_path, sizeof(file_struct_path_global) - 1);
-    file_struct_path_global[sizeof(file_struct_path_global) - 1] = '\0';
+    strncpy(journal_path_global, journal_path, sizeof(journal_path_global) - 1);
+    journal_path_global[sizeof(journal_path_global) - 1] = '\0';
 }
 
 
 
-void restore_file_system(const char *super_path, const char *file_struct_path) {
-    bool fs_exists = (access(super_path, F_OK) == 0) &&
-                     (access(file_struct_path, F_OK) == 0);
+void load_file_structure() {
+    int orphans = 0;
+    root = image_load_tree(&orphans);
+    if (!root) {
+        fprintf(stderr, "Image has no root directory.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (orphans > 0) {
+        printf("Dropped %d unreachable inodes.\n", orphans);
+    }
+}
+
+
+
+void format_file_system(const char *image_path, const char *journal_path, const image_geometry *geometry) {
+    set_fs_paths(image_path, journal_path);
+    if (image_create(image_path, geometry) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    superblock_init();
+    root_dir_init();
+    save_system_state();
+    journal_open(journal_path);
+    journal_close();
+}
+
+
+
+void restore_file_system(const char *image_path, const char *journal_path, const image_geometry *geometry) {
+    bool fs_exists = (access(image_path, F_OK) == 0);
 
     if (fs_exists) {
         if (ask_for_format_confirmation()) {
             printf("Formatting filesystem...\n");
             system("fusermount -u ~/mnt >/dev/null 2>&1");
-            set_fs_paths(super_path, file_struct_path); 
-            superblock_init();
-            root_dir_init();
-            save_system_state();
+            format_file_system(image_path, journal_path, geometry);
 
             printf("Filesystem formatted successfully.\n");
 
         } else {
             printf("Loading existing filesystem...\n");
 
-            FILE* fd = fopen(file_struct_path, "rb");
-            if (!fd) {
-                perror("Failed to open file_structure");
+            if (image_open(image_path, 1) != 0) {
                 exit(EXIT_FAILURE);
             }
+            load_file_structure();
 
-            root = malloc(sizeof(filetype));
-            if (!root) {
-                perror("Memory allocation failed");
-                exit(EXIT_FAILURE);
-            }
-            memset(root, 0, sizeof(filetype));
-            deserialize_filetype_from_file(root, fd);
-            fclose(fd);
+            set_fs_paths(image_path, journal_path); 
 
-            FILE* fd1 = fopen(super_path, "rb");
-            if (!fd1) {
-                perror("Failed to open superblock");
-                exit(EXIT_FAILURE);
+            journal_info info;
+            if (journal_replay(journal_path, &info) > 0) {
+                printf("Replayed %d journal records (%d applied).\n", info.records, info.applied);
+                // Replay only knows the live tree, snapshots still own their blocks
+                if (save_system_state() != 0 || image_rebuild_refcounts() != 0) {
+                    exit(EXIT_FAILURE);
+                }
             }
-
-            deserialize_superblock_from_file(&s_block, fd1);
-            fclose(fd1);
-
-            set_fs_paths(super_path, file_struct_path); 
-            
+            journal_open(journal_path);
+            journal_close();
 
             printf("Filesystem loaded successfully.\n");
         }
     } else {
         printf("Creating new filesystem...\n");
-        set_fs_paths(super_path, file_struct_path);  
-        superblock_init();
-        root_dir_init();
-        save_system_state();
+        format_file_system(image_path, journal_path, geometry);
         printf("Filesystem created successfully.\n");
     }
 }
@@ -185,12 +192,17 @@ void free_filetype(filetype *node) {
         free_filetype(node->children[i]);  
     }
 
-    free(node->inum);        
+    inode_free(node->inum);
+    name_release(node->name_ref);
     free(node->children);    
+    free(node->child_hash);
     free(node);             
 }
 
 void cleanup_filesystem() {
     free_filetype(root);
     root = NULL;
+    inode_table_close();
+    names_close();
+    image_close();
 }
@@ -1,13 +1,187 @@
 #include "../include/inode.h"
 
+static inode **inode_chunks = NULL; // Chunk k holds inodes [k * INODE_TABLE_CHUNK, (k + 1) * INODE_TABLE_CHUNK)
+static int num_inode_chunks = 0;
+
+// Slot of an inode number, its chunk is allocated on first use. NULL when the number is
+// out of range, memory runs out, or another node already holds the slot.
+inode *inode_table_get(int number) {
+    if (number < 0 || number >= INODE_COUNT) {
+        return NULL;
+    }
+    int k = number / INODE_TABLE_CHUNK;
+    if (k >= num_inode_chunks) {
+        int count = num_inode_chunks == 0 ? 4 : num_inode_chunks * 2;
+        while (count <= k) {
+            count *= 2;
+        }
+        inode **list = realloc(inode_chunks, count * sizeof(inode *));
+        if (list == NULL) {
+            perror("Failed to grow inode table");
+            return NULL;
+        }
+        memset(list + num_inode_chunks, 0, (count - num_inode_chunks) * sizeof(inode *));
+        inode_chunks = list;
+        num_inode_chunks = count;
+    }
+    if (inode_chunks[k] == NULL) {
+        inode_chunks[k] = calloc(INODE_TABLE_CHUNK, sizeof(inode));
+        if (inode_chunks[k] == NULL) {
+            perror("Failed to grow inode table");
+            return NULL;
+        }
+    }
+    inode *in = &inode_chunks[k][number % INODE_TABLE_CHUNK];
+    if (in->table_slot) {
+        fprintf(stderr, "Inode %d is already in memory.\n", number);
+        return NULL;
+    }
+    in->table_slot = 1;
+    in->number = number;
+    return in;
+}
+
+// The loaded inode with this number, NULL if it is not in memory
+inode *inode_table_lookup(int number) {
+    if (number < 0 || number / INODE_TABLE_CHUNK >= num_inode_chunks || inode_chunks[number / INODE_TABLE_CHUNK] == NULL) {
+        return NULL;
+    }
+    inode *in = &inode_chunks[number / INODE_TABLE_CHUNK][number % INODE_TABLE_CHUNK];
+    return in->table_slot ? in : NULL;
+}
+
+// Walks the loaded inodes in number order: start with *number = -1, NULL at the end.
+// Chunks never allocated are skipped whole.
+inode *inode_table_next(int *number) {
+    int n = *number + 1;
+    while (n / INODE_TABLE_CHUNK < num_inode_chunks) {
+        inode *chunk = inode_chunks[n / INODE_TABLE_CHUNK];
+        if (chunk == NULL) {
+            n = (n / INODE_TABLE_CHUNK + 1) * INODE_TABLE_CHUNK;
+            continue;
+        }
+        if (chunk[n % INODE_TABLE_CHUNK].table_slot) {
+            *number = n;
+            return &chunk[n % INODE_TABLE_CHUNK];
+        }
+        n++;
+    }
+    return NULL;
+}
+
+// Drops the runs of an inode and empties its slot, or frees a separately allocated one
+void inode_free(inode *in) {
+    if (in == NULL) {
+        return;
+    }
+    extent_free(in);
+    if (in->table_slot) {
+        memset(in, 0, sizeof(*in));
+    } else {
+        free(in);
+    }
+}
+
+// Only after every node of the live tree is freed
+void inode_table_close() {
+    for (int k = 0; k < num_inode_chunks; k++) {
+        free(inode_chunks[k]);
+    }
+    free(inode_chunks);
+    inode_chunks = NULL;
+    num_inode_chunks = 0;
+}
+
+// Takes a free inode number out of the group, -1 when it has none left. Numbers
+// released since the mount come first, off the group's free list, so new inodes
+// reuse the slots of deleted ones and the table stays dense.
+static int take_inode(alloc_group *g) {
+    pthread_mutex_lock(&g->lock);
+    long bit = -1;
+    while (g->free_inodes > 0 && g->free_list_len > 0) {
+        uint32_t number = g->free_list[--g->free_list_len];
+        if (!bitmap_test(s_block.inode_bitmap, number)) {
+            bit = number - g->first_inode; // Entries taken by the bitmap search since are skipped
+            break;
+        }
+    }
+    if (bit == -1 && g->free_inodes > 0) {
+        // Inodes 0 and 1 are reserved
+        bit = bitmap_find_free(s_block.inode_bitmap + g->first_inode / BITMAP_WORD_BITS, g->num_inodes,
+                               g->first_inode == 0 ? 2 : 0, g->inode_hint);
+        if (bit != -1) {
+            g->inode_hint = bit + 1;
+        }
+    }
+    if (bit != -1) {
+        bitmap_set(s_block.inode_bitmap, g->first_inode + bit);
+        image_superblock_changed(&s_block.inode_bitmap[(g->first_inode + bit) / BITMAP_WORD_BITS], sizeof(uint64_t));
+        g->free_inodes--;
+    }
+    pthread_mutex_unlock(&g->lock);
+    return bit == -1 ? -1 : (int)(g->first_inode + bit);
+}
+
+// Searches the given group first, then the ones after it
+static int find_free_inode_from(int first) {
+    for (int k = 0; k < num_groups; k++) {
+        int number = take_inode(&groups[(first + k) % num_groups]);
+        if (number != -1) {
+            return number;
+        }
+    }
+    return -1;
+}
+
+// The root is the first inode handed out
 int find_free_inode() {
-    for (int i = 2; i < 100; i++) {
-        if (s_block.inode_bitmap[i] == '0') {
-            s_block.inode_bitmap[i] = '1';
-            return i; 
+    return find_free_inode_from(0);
+}
+
+// A file goes to the group of its directory, so the directory, its inodes and
+// their data stay close. A new directory goes to the group with the most free
+// blocks that still has inodes, spreading unrelated trees over the disk.
+int find_free_inode_near(int parent, int directory) {
+    int first = group_of_inode(parent);
+    if (directory) {
+        uint32_t most_free = 0;
+        for (int g = 0; g < num_groups; g++) {
+            pthread_mutex_lock(&groups[g].lock);
+            if (groups[g].free_inodes > 0 && groups[g].free_blocks > most_free) {
+                most_free = groups[g].free_blocks;
+                first = g;
+            }
+            pthread_mutex_unlock(&groups[g].lock);
+        }
+    }
+    return find_free_inode_from(first);
+}
+
+// Returns an inode number to its group
+void release_inode_number(int number) {
+    if (number < 2 || number >= INODE_COUNT) {
+        return;
+    }
+    alloc_group *g = &groups[group_of_inode(number)];
+    pthread_mutex_lock(&g->lock);
+    if (bitmap_test(s_block.inode_bitmap, number)) {
+        bitmap_clear(s_block.inode_bitmap, number);
+        image_superblock_changed(&s_block.inode_bitmap[number / BITMAP_WORD_BITS], sizeof(uint64_t));
+        g->free_inodes++;
+        // A full list only loses the shortcut, the bitmap search still finds the number
+        if (g->free_list_len == g->free_list_capacity && g->free_list_capacity < g->num_inodes) {
+            uint32_t capacity = g->free_list_capacity == 0 ? 16 : g->free_list_capacity * 2;
+            uint32_t *list = realloc(g->free_list, capacity * sizeof(uint32_t));
+            if (list != NULL) {
+                g->free_list = list;
+                g->free_list_capacity = capacity;
+            }
+        }
+        if (g->free_list_len < g->free_list_capacity) {
+            g->free_list[g->free_list_len++] = (uint32_t)number;
         }
     }
-    return -1; 
+    pthread_mutex_unlock(&g->lock);
 }
 
 void add_child(filetype *parent, filetype *child) {
@@ -21,4 +195,6 @@ void add_child(filetype *parent, filetype *child) {
 
     parent->children = new_children;
     parent->children[parent->num_children - 1] = child;
+    child->child_slot = parent->num_children - 1;
+    child_index_add(parent, child);
 }
\ No newline at end of file
@@ -1,19 +1,108 @@
-
+#define _POSIX_C_SOURCE 200809L
 #include "../include/fs_init.h"
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-b block_size] [-s size[K|M|G]] [-i inode_count] [-S snapshot_slots] <sfs_directory>\n", prog);
+    printf("  -s  size of the data area, the metadata regions come on top of it\n");
+    printf("  -S  snapshot slots, each reserves a copy of the inode table and dirent area\n");
+    printf("      (%d bytes per inode). Default: as many as fit in 1/%d of the data area,\n",
+           INODE_RECORD_SIZE + DIRENT_RECORD_SIZE, SNAPSHOT_SPACE_SHARE);
+    printf("      at least 1 and at most %d. -S 0 disables snapshots.\n", MAX_SNAPSHOTS);
+}
+
+// Parses a byte count with an optional K, M or G suffix
+static int parse_size(const char *text, unsigned long long *value) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(text, &end, 10);
+    if (errno != 0 || end == text) {
+        return -1;
+    }
+    int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || v > ULLONG_MAX >> shift) { // The shifted value would wrap around
+        return -1;
+    }
+    *value = v << shift;
+    return 0;
+}
 
 int main(int argc, char *argv[]){
+    image_geometry geometry;
+    image_default_geometry(&geometry);
+    unsigned long long size = 0;
+    unsigned long long value;
+    int snapshots_given = 0;
 
-    if (argc < 2) {
-        printf("Usage: %s <sfs_directory>\n", argv[0]);
+    int opt;
+    while ((opt = getopt(argc, argv, "b:s:i:S:")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (parse_size(optarg, &value) != 0 || value > UINT32_MAX) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                geometry.data_block_size = (uint32_t)value;
+                break;
+            case 's':
+                if (parse_size(optarg, &size) != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'i':
+                if (parse_size(optarg, &value) != 0 || value > UINT32_MAX) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                geometry.inode_count = (uint32_t)value;
+                break;
+            case 'S':
+                if (parse_size(optarg, &value) != 0 || value > UINT32_MAX) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                geometry.snapshot_slots = (uint32_t)value;
+                snapshots_given = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    // The size covers the data area, the metadata regions come on top of it
+    if (size > 0) {
+        unsigned long long blocks = size / geometry.data_block_size;
+        geometry.block_count = blocks > UINT32_MAX ? UINT32_MAX : (uint32_t)blocks;
+    }
+    if (!snapshots_given) {
+        geometry.snapshot_slots = image_default_snapshot_slots(&geometry);
+    }
+    if (image_check_geometry(&geometry) != 0) {
         return 1;
     }
-    const char *sfs_path = argv[1];
-    char super_path[256];
-    char file_struct_path[256];
-    snprintf(super_path, sizeof(super_path), "%s/super.bin", sfs_path);
-    snprintf(file_struct_path, sizeof(file_struct_path), "%s/file_structure.bin", sfs_path);
-    restore_file_system(super_path, file_struct_path );
+    printf("Geometry: %u blocks of %u bytes, %u inodes, %u snapshot slots of %llu bytes\n",
+           geometry.block_count, geometry.data_block_size, geometry.inode_count, geometry.snapshot_slots,
+           (unsigned long long)image_snapshot_slot_size(&geometry));
+
+    const char *sfs_path = argv[optind];
+    char image_path[256];
+    char journal_path[256];
+    snprintf(image_path, sizeof(image_path), "%s/sfs.img", sfs_path);
+    snprintf(journal_path, sizeof(journal_path), "%s/journal.bin", sfs_path);
+    restore_file_system(image_path, journal_path, &geometry);
     cleanup_filesystem();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,112 @@
+#include "../include/names.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char **chunks = NULL;       // NAME_CHUNK_SIZE bytes each
+static uint32_t num_chunks = 0;
+static uint32_t chunk_used = 0;    // Bytes handed out from the last chunk
+static uint32_t free_slots[NAME_SLOT_CLASSES]; // First free slot of each size, 0 for none
+static name_stats stats;
+
+static uint32_t slot_size(int cls) {
+    return (uint32_t)NAME_MIN_SLOT << cls;
+}
+
+static char *slot_at(uint32_t ref) {
+    return chunks[ref / NAME_CHUNK_SIZE] + ref % NAME_CHUNK_SIZE;
+}
+
+// A name's length decides its slot size, the same size comes back on release
+static int slot_class(size_t len) {
+    int cls = 0;
+    while (cls < NAME_SLOT_CLASSES && slot_size(cls) < len + 1) {
+        cls++;
+    }
+    return cls;
+}
+
+static int add_chunk() {
+    if (num_chunks == UINT32_MAX / NAME_CHUNK_SIZE) {
+        return -1;
+    }
+    char **list = realloc(chunks, (num_chunks + 1) * sizeof(char *));
+    if (list == NULL) {
+        return -1;
+    }
+    chunks = list;
+    chunks[num_chunks] = calloc(1, NAME_CHUNK_SIZE);
+    if (chunks[num_chunks] == NULL) {
+        return -1;
+    }
+    num_chunks++;
+    chunk_used = 0;
+    stats.chunk_bytes += NAME_CHUNK_SIZE;
+    return 0;
+}
+
+// Copies the first len bytes of name into a slot, returns its reference or 0 when
+// the name is too long or memory runs out
+uint32_t name_store(const char *name, size_t len) {
+    int cls = slot_class(len);
+    if (len > NAME_MAX_LEN || cls == NAME_SLOT_CLASSES) {
+        return 0;
+    }
+    if (num_chunks == 0) {
+        if (add_chunk() != 0) {
+            return 0;
+        }
+        chunk_used = NAME_MIN_SLOT; // The empty name
+    }
+
+    uint32_t ref = free_slots[cls];
+    if (ref != 0) {
+        memcpy(&free_slots[cls], slot_at(ref), sizeof(uint32_t));
+    } else {
+        // Slot sizes divide the chunk size, a slot never crosses into the next chunk
+        if (chunk_used + slot_size(cls) > NAME_CHUNK_SIZE && add_chunk() != 0) {
+            return 0;
+        }
+        ref = (num_chunks - 1) * NAME_CHUNK_SIZE + chunk_used;
+        chunk_used += slot_size(cls);
+    }
+
+    char *slot = slot_at(ref);
+    memcpy(slot, name, len);
+    slot[len] = '\0';
+    stats.used_bytes += slot_size(cls);
+    stats.names++;
+    return ref;
+}
+
+const char *name_str(uint32_t ref) {
+    return ref != 0 ? slot_at(ref) : "";
+}
+
+void name_release(uint32_t ref) {
+    if (ref == 0) {
+        return;
+    }
+    char *slot = slot_at(ref);
+    int cls = slot_class(strlen(slot));
+    memcpy(slot, &free_slots[cls], sizeof(uint32_t));
+    free_slots[cls] = ref;
+    stats.used_bytes -= slot_size(cls);
+    stats.names--;
+}
+
+name_stats names_get_stats() {
+    return stats;
+}
+
+void names_close() {
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        free(chunks[i]);
+    }
+    free(chunks);
+    chunks = NULL;
+    num_chunks = 0;
+    chunk_used = 0;
+    memset(free_slots, 0, sizeof(free_slots));
+    memset(&stats, 0, sizeof(stats));
+}
@@ -1,18 +1,252 @@
 #include "../include/superblock.h"
+#include "../include/image.h"
+#include <stdlib.h>
 
 superblock s_block;
 
 void superblock_init() {
-    memset(s_block.data_bitmap, '0', sizeof(s_block.data_bitmap));
-    memset(s_block.inode_bitmap, '0', sizeof(s_block.inode_bitmap));
+    memset(s_block.data_bitmap, 0, bitmap_bytes(BLOCK_COUNT));
+    memset(s_block.inode_bitmap, 0, bitmap_bytes(INODE_COUNT));
+    memset(s_block.refcounts, 0, BLOCK_COUNT);
+    image_superblock_changed(s_block.data_bitmap, bitmap_bytes(BLOCK_COUNT));
+    image_superblock_changed(s_block.inode_bitmap, bitmap_bytes(INODE_COUNT));
+    image_superblock_changed(s_block.refcounts, BLOCK_COUNT);
+    groups_recount();
+}
+
+// Group that allocations without a goal start in, the one that last served this thread.
+// Every caller with an inode passes a goal in the inode's group, so the cursor is private
+// to the thread and no allocation writes state shared by all groups.
+static _Thread_local int thread_group = -1;
+
+// Preallocated blocks are free in the bitmap but set in their group's reserved_map.
+// The caller of all of the helpers below holds the group lock.
+static int block_reserved(const alloc_group *g, size_t block) {
+    return bitmap_test(g->reserved_map, block - g->first_block);
+}
+
+static void unreserve_block(alloc_group *g, size_t block) {
+    if (block_reserved(g, block)) {
+        bitmap_clear(g->reserved_map, block - g->first_block);
+        g->reserved_blocks--;
+    }
+}
+
+// First free block of the group at or after from, wrapping around inside the group.
+// A from outside the group continues after its last allocation. Blocks reserved by
+// other files are skipped unless take_reserved is set.
+static long find_in_group(alloc_group *g, long from, int take_reserved) {
+    const uint64_t *map = s_block.data_bitmap + g->first_block / BITMAP_WORD_BITS;
+    size_t first = g->first_block == 0 ? 1 : 0; // Block 0 is never handed out
+    size_t hint = from >= (long)g->first_block && from < (long)(g->first_block + g->num_blocks)
+                  ? (size_t)from - g->first_block : g->block_hint;
+    long bit = bitmap_find_free(map, g->num_blocks, first, hint);
+    for (size_t skipped = 0; !take_reserved && bit != -1 && block_reserved(g, g->first_block + bit); skipped++) {
+        if (skipped == g->reserved_blocks) {
+            return -1; // Every free block of the group is reserved
+        }
+        bit = bitmap_find_free(map, g->num_blocks, first, bit + 1);
+    }
+    return bit == -1 ? -1 : (long)g->first_block + bit;
+}
+
+// The bitmap word and the reference count of a block go out with the next commit
+static void block_changed(long block) {
+    image_superblock_changed(&s_block.data_bitmap[block / BITMAP_WORD_BITS], sizeof(uint64_t));
+    image_superblock_changed(&s_block.refcounts[block], 1);
+}
+
+static int claim_block(alloc_group *g, long block) {
+    unreserve_block(g, block);
+    bitmap_set(s_block.data_bitmap, block);
+    s_block.refcounts[block] = 1;
+    block_changed(block);
+    g->free_blocks--;
+    g->block_hint = block + 1 - g->first_block;
+    return (int)block;
+}
+
+static int start_group(int goal) {
+    if (goal > 0 && goal < BLOCK_COUNT) {
+        return group_of_block(goal);
+    }
+    return thread_group >= 0 && thread_group < num_groups ? thread_group : 0;
+}
+
+// Goal-directed allocation: the goal block when it is free, otherwise the next free
+// block of its group, otherwise the groups after it. Reservations of other files
+// give way only when nothing else is left.
+int find_free_db_near(int goal) {
+    int first = start_group(goal);
+    for (int take_reserved = 0; take_reserved <= 1; take_reserved++) {
+        for (int k = 0; k < num_groups; k++) {
+            int index = (first + k) % num_groups;
+            alloc_group *g = &groups[index];
+            pthread_mutex_lock(&g->lock);
+            long block = -1;
+            if (g->free_blocks > (take_reserved ? 0 : g->reserved_blocks)) {
+                block = find_in_group(g, k == 0 && goal > 0 ? goal : -1, take_reserved);
+            }
+            if (block != -1) {
+                claim_block(g, block);
+                pthread_mutex_unlock(&g->lock);
+                thread_group = index;
+                return (int)block;
+            }
+            pthread_mutex_unlock(&g->lock);
+        }
+    }
+    return -1; // No free data block found
 }
 
 int find_free_db() {
-    for (int i = 1; i < 100; i++) {
-        if (s_block.data_bitmap[i] == '0') {
-            s_block.data_bitmap[i] = '1';
-            return i; 
+    return find_free_db_near(0);
+}
+
+// Length of the free, unreserved run starting at block, at most want. Runs end at
+// the group boundary.
+static int free_run(alloc_group *g, size_t block, int want) {
+    const uint64_t *map = s_block.data_bitmap + g->first_block / BITMAP_WORD_BITS;
+    int len = (int)bitmap_free_run(map, g->num_blocks, block - g->first_block, want);
+    int k = 0;
+    while (k < len && !block_reserved(g, block + k)) {
+        k++;
+    }
+    return k;
+}
+
+// Best run of up to want blocks in one group: at the goal when the run there is long
+// enough, otherwise the first such run after it, otherwise the longest run seen
+static int reserve_in_group(alloc_group *g, long goal, int want, int *start) {
+    long best = -1;
+    int best_len = 0;
+    long block = find_in_group(g, goal, 0);
+    // A bounded number of candidate runs, a full group is not scanned on every append
+    for (int tries = 0; block != -1 && tries < RESERVE_SEARCH_RUNS; tries++) {
+        int len = free_run(g, block, want);
+        if (len > best_len) {
+            best = block;
+            best_len = len;
+        }
+        if (len == want || block + len >= (long)(g->first_block + g->num_blocks)) {
+            break;
         }
+        long next = find_in_group(g, block + len, 0);
+        if (next <= block) {
+            break; // Wrapped around
+        }
+        block = next;
+    }
+    for (int k = 0; k < best_len; k++) {
+        bitmap_set(g->reserved_map, best + k - g->first_block);
     }
-    return -1; 
-}
\ No newline at end of file
+    g->reserved_blocks += best_len;
+    *start = (int)best;
+    return best_len;
+}
+
+// Reserves up to want contiguous free blocks, in the goal's group when it has any.
+// Returns the number of blocks reserved, the first one in *start.
+int reserve_blocks(int goal, int want, int *start) {
+    int first = start_group(goal);
+    *start = -1;
+    for (int k = 0; k < num_groups; k++) {
+        int index = (first + k) % num_groups;
+        alloc_group *g = &groups[index];
+        pthread_mutex_lock(&g->lock);
+        int got = 0;
+        if (g->free_blocks > g->reserved_blocks) {
+            got = reserve_in_group(g, k == 0 && goal > 0 ? goal : -1, want, start);
+        }
+        pthread_mutex_unlock(&g->lock);
+        if (got > 0) {
+            thread_group = index;
+            return got;
+        }
+    }
+    return 0;
+}
+
+void unreserve_blocks(int start, int count) {
+    int k = 0;
+    while (k < count) {
+        if (start + k <= 0 || start + k >= BLOCK_COUNT) {
+            k++;
+            continue;
+        }
+        alloc_group *g = &groups[group_of_block(start + k)];
+        pthread_mutex_lock(&g->lock);
+        for (; k < count && start + k < (int)(g->first_block + g->num_blocks); k++) {
+            unreserve_block(g, start + k);
+        }
+        pthread_mutex_unlock(&g->lock);
+    }
+}
+
+// Allocates a block out of the caller's own reservation. -1 when it went to
+// another file after all because the disk was full.
+int claim_reserved_block(int block) {
+    if (block <= 0 || block >= BLOCK_COUNT) {
+        return -1;
+    }
+    alloc_group *g = &groups[group_of_block(block)];
+    pthread_mutex_lock(&g->lock);
+    int claimed = -1;
+    if (block_reserved(g, block) && !bitmap_test(s_block.data_bitmap, block)) {
+        claimed = claim_block(g, block);
+    }
+    pthread_mutex_unlock(&g->lock);
+    return claimed;
+}
+
+// Free data blocks of the whole image, reserved ones included
+long free_block_count() {
+    long count = 0;
+    for (int g = 0; g < num_groups; g++) {
+        pthread_mutex_lock(&groups[g].lock);
+        count += groups[g].free_blocks;
+        pthread_mutex_unlock(&groups[g].lock);
+    }
+    return count;
+}
+
+void block_ref(int block) {
+    if (block >= 0 && block < BLOCK_COUNT) {
+        alloc_group *g = &groups[group_of_block(block)];
+        pthread_mutex_lock(&g->lock);
+        if (block > 0 && !bitmap_test(s_block.data_bitmap, block)) {
+            g->free_blocks--;
+        }
+        s_block.refcounts[block]++;
+        bitmap_set(s_block.data_bitmap, block);
+        block_changed(block);
+        pthread_mutex_unlock(&g->lock);
+    }
+}
+
+// Drops one reference, the block becomes free with the last one
+int block_unref(int block) {
+    if (block < 0 || block >= BLOCK_COUNT) {
+        return 0;
+    }
+    alloc_group *g = &groups[group_of_block(block)];
+    pthread_mutex_lock(&g->lock);
+    if (s_block.refcounts[block] > 0) {
+        s_block.refcounts[block]--;
+    }
+    if (s_block.refcounts[block] == 0 && bitmap_test(s_block.data_bitmap, block)) {
+        bitmap_clear(s_block.data_bitmap, block);
+        if (block > 0) {
+            g->free_blocks++;
+        }
+    }
+    block_changed(block);
+    int refs = s_block.refcounts[block];
+    pthread_mutex_unlock(&g->lock);
+    return refs;
+}
+
+// A shared block belongs to a snapshot as well and must be copied before a write
+int block_shared(int block) {
+    return block >= 0 && block < BLOCK_COUNT && s_block.refcounts[block] > 1;
+}
@@ -1,182 +1,362 @@
 #include "../include/utilities.h"
+#include "../include/names.h"
+#include "../include/image.h"
 
-void serialize_superblock_to_file(superblock *sb, FILE *fp) {
-    fwrite(sb->data_blocks, sizeof(char), block_size * 100, fp);
-    fwrite(sb->data_bitmap, sizeof(char), 105, fp);
-    fwrite(sb->inode_bitmap, sizeof(char), 105, fp);
-}
-
-// Десериализация структуры superblock из файла
-void deserialize_superblock_from_file(superblock *sb, FILE *fp) {
-    fread(sb->data_blocks, sizeof(char), block_size * 100, fp);
-    fread(sb->data_bitmap, sizeof(char), 105, fp);
-    fread(sb->inode_bitmap, sizeof(char), 105, fp);
-}
-
-void serialize_inode_to_file(inode *i, FILE *fp) {
-    fwrite(i->datablocks, sizeof(int), 16, fp);
-    fwrite(&i->number, sizeof(int), 1, fp);
-    fwrite(&i->blocks, sizeof(int), 1, fp);
-    fwrite(&i->size, sizeof(int), 1, fp);
-    fwrite(&i->permissions, sizeof(mode_t), 1, fp);
-    fwrite(&i->user_id, sizeof(uid_t), 1, fp);
-    fwrite(&i->group_id, sizeof(gid_t), 1, fp);
-    fwrite(&i->a_time, sizeof(time_t), 1, fp);
-    fwrite(&i->m_time, sizeof(time_t), 1, fp);
-    fwrite(&i->c_time, sizeof(time_t), 1, fp);
-    fwrite(&i->b_time, sizeof(time_t), 1, fp);
-}
-
-void deserialize_inode_from_file(inode *i, FILE *fp) {
-    fread(i->datablocks, sizeof(int), 16, fp);
-    fread(&i->number, sizeof(int), 1, fp);
-    fread(&i->blocks, sizeof(int), 1, fp);
-    fread(&i->size, sizeof(int), 1, fp);
-    fread(&i->permissions, sizeof(mode_t), 1, fp);
-    fread(&i->user_id, sizeof(uid_t), 1, fp);
-    fread(&i->group_id, sizeof(gid_t), 1, fp);
-    fread(&i->a_time, sizeof(time_t), 1, fp);
-    fread(&i->m_time, sizeof(time_t), 1, fp);
-    fread(&i->c_time, sizeof(time_t), 1, fp);
-    fread(&i->b_time, sizeof(time_t), 1, fp);
-}
-
-void serialize_filetype_to_file(filetype *f, FILE *fp) {
-    fwrite(&f->valid, sizeof(int), 1, fp);
-    fwrite(f->path, sizeof(char), 100, fp);
-    fwrite(f->name, sizeof(char), 100, fp);
-    if (f->inum != NULL) {
-        int null_flag = 1;
-        fwrite(&null_flag, sizeof(int), 1, fp);
-
-        serialize_inode_to_file(f->inum, fp);
-    } else {
-        int null_flag = 0;
-        fwrite(&null_flag, sizeof(int), 1, fp);
-    }
-    fwrite(&f->num_children, sizeof(int), 1, fp);
-    fwrite(&f->num_links, sizeof(int), 1, fp);
-    fwrite(f->type, sizeof(char), 20, fp);
-    if (f->num_children > 0) {
-        for (int i = 0; i < f->num_children; i++) {
-            serialize_filetype_to_file(f->children[i], fp);
-        }
+_Static_assert(DIRENT_NAME_LEN == NAME_MAX_LEN, "a name the arena holds must fit a dirent record");
+
+// On-disk records are little-endian with fixed field widths,
+// so images move between builds regardless of the native mode_t/uid_t/time_t
+void put_le32(char *buf, uint32_t v) {
+    for (int k = 0; k < 4; k++) {
+        buf[k] = (char)(v >> (8 * k));
     }
 }
 
-void deserialize_filetype_from_file(filetype *f, FILE *fp) {
-    if (!f || !fp) return;
+void put_le64(char *buf, uint64_t v) {
+    for (int k = 0; k < 8; k++) {
+        buf[k] = (char)(v >> (8 * k));
+    }
+}
 
-    size_t bytes_read;
+uint32_t get_le32(const char *buf) {
+    uint32_t v = 0;
+    for (int k = 0; k < 4; k++) {
+        v |= (uint32_t)(unsigned char)buf[k] << (8 * k);
+    }
+    return v;
+}
 
-    bytes_read = fread(&f->valid, sizeof(int), 1, fp);
-    if (bytes_read != 1) return; // Проверка чтения
+uint64_t get_le64(const char *buf) {
+    uint64_t v = 0;
+    for (int k = 0; k < 8; k++) {
+        v |= (uint64_t)(unsigned char)buf[k] << (8 * k);
+    }
+    return v;
+}
 
-    bytes_read = fread(f->path, sizeof(char), 100, fp);
-    if (bytes_read != 100) return;
-    f->path[99] = '\0';
+static void pack_runs(const extent *runs, int count, char *buf) {
+    for (int k = 0; k < count; k++) {
+        put_le32(buf + EXTENT_RECORD_SIZE * k + 0, runs[k].logical);
+        put_le32(buf + EXTENT_RECORD_SIZE * k + 4, runs[k].start);
+        put_le32(buf + EXTENT_RECORD_SIZE * k + 8, runs[k].length);
+    }
+}
 
-    bytes_read = fread(f->name, sizeof(char), 100, fp);
-    if (bytes_read != 100) return;
-    f->name[99] = '\0';
-    printf("Deserializing: %s at %s\n", f->name, f->path); // Теперь печатаем после загрузки
+// Appends count runs to a list with room for them, rejecting unsorted or out-of-range ones
+static int append_runs(inode *i, const char *buf, uint32_t count) {
+    uint64_t next = 0;
+    if (i->num_extents > 0) {
+        const extent *last = &i->extents[i->num_extents - 1];
+        next = (uint64_t)last->logical + last->length;
+    }
+    for (uint32_t k = 0; k < count; k++) {
+        extent *e = &i->extents[i->num_extents];
+        e->logical = get_le32(buf + EXTENT_RECORD_SIZE * k + 0);
+        e->start = get_le32(buf + EXTENT_RECORD_SIZE * k + 4);
+        e->length = get_le32(buf + EXTENT_RECORD_SIZE * k + 8);
+        if (e->length == 0 || e->logical < next || e->start == 0 ||
+            (uint64_t)e->start + e->length > (uint64_t)BLOCK_COUNT) {
+            return -1;
+        }
+        next = (uint64_t)e->logical + e->length;
+        i->num_extents++;
+    }
+    return 0;
+}
 
-    int null_flag;
-    bytes_read = fread(&null_flag, sizeof(int), 1, fp);
-    if (bytes_read != 1) return;
+static int alloc_runs(inode *i, uint32_t count) {
+    i->extents = NULL;
+    i->num_extents = 0;
+    i->extent_capacity = 0;
+    if (count == 0) {
+        return 0;
+    }
+    i->extents = malloc(count * sizeof(extent));
+    if (i->extents == NULL) {
+        perror("Failed to allocate extent list");
+        return -1;
+    }
+    i->extent_capacity = (int)count;
+    return 0;
+}
 
-    if (null_flag == 1) {
-        inode *inum = calloc(1, sizeof(inode)); // Используем calloc для обнуления
-        if (!inum) {
-            perror("malloc failed for inode during deserialization");
-            exit(EXIT_FAILURE); // Критическая ошибка, завершаем
+// Extent tree node: magic, entry count, owner inode number, level (le32), then runs
+// for a leaf (level 0) or first file block and child node (le32) for an index node
+static int walk_node(int block, int level, int owner, extent_visit visit, void *arg) {
+    if (block <= 0 || block >= BLOCK_COUNT) {
+        return -1;
+    }
+    const char *node = s_block.data_blocks + (size_t)block * block_size;
+    uint32_t count = get_le32(node + 4);
+    uint32_t capacity = level == 0 ? extent_leaf_capacity() : extent_index_capacity();
+    if (get_le32(node) != EXTENT_BLOCK_MAGIC || get_le32(node + 8) != (uint32_t)owner ||
+        get_le32(node + 12) != (uint32_t)level || count == 0 || count > capacity) {
+        return -1;
+    }
+    if (visit(block, level, node + EXTENT_BLOCK_HEADER, count, arg) != 0) {
+        return -1;
+    }
+    for (uint32_t k = 0; level > 0 && k < count; k++) {
+        int child = (int)get_le32(node + EXTENT_BLOCK_HEADER + EXTENT_INDEX_SIZE * k + 4);
+        if (walk_node(child, level - 1, owner, visit, arg) != 0) {
+            return -1;
         }
-        deserialize_inode_from_file(inum, fp);
-        f->inum = inum;
-    } else {
-        f->inum = NULL;
     }
+    return 0;
+}
 
-    bytes_read = fread(&f->num_children, sizeof(int), 1, fp);
-    if (bytes_read != 1) return;
-
-    bytes_read = fread(&f->num_links, sizeof(int), 1, fp);
-    if (bytes_read != 1) return;
+// Visits every node of an extent tree of the given depth, parents before children and
+// left to right. Stops with -1 at the first node whose header does not match.
+int walk_extent_tree(int root, int depth, int owner, extent_visit visit, void *arg) {
+    if (depth < 1 || depth > EXTENT_MAX_DEPTH) {
+        return -1;
+    }
+    return walk_node(root, depth - 1, owner, visit, arg);
+}
 
-    bytes_read = fread(f->type, sizeof(char), 20, fp);
-    if (bytes_read != 20) return;
-    f->type[19] = '\0';
+static int read_leaf(int block, int level, const char *entries, uint32_t count, void *arg) {
+    (void) block;
+    inode *i = arg;
+    if (level > 0) {
+        return 0;
+    }
+    if ((uint64_t)i->num_extents + count > (uint64_t)i->extent_capacity) {
+        return -1;
+    }
+    return append_runs(i, entries, count);
+}
 
-    if (f->num_children > 0) {
-        // Освобождаем старый массив детей, если он был (например, при повторном вызове)
-        if (f->children != NULL) {
-            // Если free_filetype уже вызывается рекурсивно, то это не нужно.
-            // Но если вы хотите быть на 100% уверенным, что старые указатели не утекут,
-            // то здесь нужно их освободить, прежде чем перевыделять.
-            // Однако, в контексте восстановления из файла, f->children обычно NULL.
-            // Но если root уже был создан и пересоздается, то тут проблема.
-            // Самый безопасный путь - убедиться, что root очищается перед восстановлением.
-        }
-        f->children = calloc(f->num_children, sizeof(filetype*)); // Используем calloc для обнуления
-        if (!f->children) {
-            perror("malloc failed for children array during deserialization");
-            exit(EXIT_FAILURE);
-        }
-        for (int i = 0; i < f->num_children; i++) {
-            filetype *child = calloc(1, sizeof(filetype)); // Используем calloc для обнуления
-            if (!child) {
-                perror("malloc failed for child during deserialization");
-                exit(EXIT_FAILURE);
-            }
-            // Рекурсивный вызов для десериализации ребенка
-            deserialize_filetype_from_file(child, fp);
-            f->children[i] = child;
-            child->parent = f; // Устанавливаем указатель на родителя! Это очень важно.
-        }
+// Inode record: number, mode, uid, gid (le32), size (le64), blocks, run count (le32),
+// a/m/c/b time (le64), extent tree root, tree depth, flags (le32), then at offset 80 the
+// block area: up to INODE_INLINE_EXTENTS runs of logical, start, length (le32), or the
+// contents of a file flagged INODE_FLAG_INLINE_DATA. Longer lists are in the tree.
+size_t pack_inode(const inode *i, char *buf) {
+    memset(buf, 0, INODE_RECORD_SIZE);
+    put_le32(buf + 0, (uint32_t)i->number);
+    put_le32(buf + 4, (uint32_t)i->permissions);
+    put_le32(buf + 8, (uint32_t)i->user_id);
+    put_le32(buf + 12, (uint32_t)i->group_id);
+    put_le64(buf + 16, (uint64_t)i->size);
+    put_le32(buf + 24, (uint32_t)i->blocks);
+    put_le32(buf + 28, (uint32_t)i->num_extents);
+    put_le64(buf + 32, (uint64_t)i->a_time);
+    put_le64(buf + 40, (uint64_t)i->m_time);
+    put_le64(buf + 48, (uint64_t)i->c_time);
+    put_le64(buf + 56, (uint64_t)i->b_time);
+    if (i->data_inline) {
+        put_le32(buf + 72, INODE_FLAG_INLINE_DATA);
+        memcpy(buf + 80, i->inline_data, INODE_INLINE_DATA);
+    } else if (i->num_extents > INODE_INLINE_EXTENTS) {
+        put_le32(buf + 64, (uint32_t)i->extent_block);
+        put_le32(buf + 68, (uint32_t)i->extent_depth);
     } else {
-        // Если детей нет, убедимся, что children NULL, чтобы избежать висячих указателей
-        if (f->children != NULL) {
-            free(f->children);
-            f->children = NULL;
-        }
+        pack_runs(i->extents, i->num_extents, buf + 80);
     }
+    return INODE_RECORD_SIZE;
 }
 
+// Unpacks a record and its runs. A long list is read from runs when given (journal
+// records carry their own copy), otherwise from the extent tree the record names.
+// Returns -1 and leaves the inode unmapped when the list is unreadable.
+int unpack_inode(inode *i, const char *buf, const char *runs) {
+    i->number = (int)get_le32(buf + 0);
+    i->permissions = (mode_t)get_le32(buf + 4);
+    i->user_id = (uid_t)get_le32(buf + 8);
+    i->group_id = (gid_t)get_le32(buf + 12);
+    i->size = (off_t)get_le64(buf + 16);
+    i->blocks = (int)get_le32(buf + 24);
+    i->a_time = (time_t)(int64_t)get_le64(buf + 32);
+    i->m_time = (time_t)(int64_t)get_le64(buf + 40);
+    i->c_time = (time_t)(int64_t)get_le64(buf + 48);
+    i->b_time = (time_t)(int64_t)get_le64(buf + 56);
+    i->extent_block = 0;
+    i->extent_depth = 0;
+    i->extent_hint = 0;
+    i->extents_dirty = 0;
 
-char* get_file_name(const char* path) {
-    char* dest_path = malloc(strlen(path) + 1);
-    if (dest_path == NULL) {
-        return NULL;
+    uint32_t count = get_le32(buf + 28);
+    i->data_inline = (get_le32(buf + 72) & INODE_FLAG_INLINE_DATA) != 0;
+    memset(i->inline_data, 0, INODE_INLINE_DATA);
+    if (i->data_inline) {
+        alloc_runs(i, 0);
+        if (count != 0 || i->size < 0 || i->size > INODE_INLINE_DATA) {
+            i->data_inline = 0;
+            return -1;
+        }
+        memcpy(i->inline_data, buf + 80, (size_t)i->size);
+        return 0;
     }
-    strcpy(dest_path, path);
-
-    char* dest_name = strrchr(dest_path, '/');
-    if (dest_name != NULL) {
-        dest_name++;
+    if (count <= INODE_INLINE_EXTENTS) {
+        runs = buf + 80;
     } else {
-        dest_name = dest_path;
+        i->extent_block = (int)get_le32(buf + 64);
+        i->extent_depth = (int)get_le32(buf + 68);
+    }
+    if (count > extent_max_runs() || alloc_runs(i, count) != 0) {
+        alloc_runs(i, 0);
+        return -1;
+    }
+    int ret = runs != NULL ? append_runs(i, runs, count)
+                           : walk_extent_tree(i->extent_block, i->extent_depth, i->number, read_leaf, i);
+    if (ret != 0 || i->num_extents != (int)count) {
+        extent_free(i);
+        return -1;
+    }
+    return 0;
+}
+
+// Runs beyond the inline ones, appended to journal records
+size_t pack_extents(const inode *i, char *buf) {
+    if (i->num_extents <= INODE_INLINE_EXTENTS) {
+        return 0;
     }
+    pack_runs(i->extents, i->num_extents, buf);
+    return (size_t)i->num_extents * EXTENT_RECORD_SIZE;
+}
 
-    return dest_name;
+// Fills one extent tree node. Leaves take runs, index nodes take
+// (first file block, child node) pairs.
+void pack_extent_leaf(const inode *i, const extent *runs, int count, char *buf) {
+    memset(buf, 0, block_size);
+    put_le32(buf + 0, EXTENT_BLOCK_MAGIC);
+    put_le32(buf + 4, (uint32_t)count);
+    put_le32(buf + 8, (uint32_t)i->number);
+    put_le32(buf + 12, 0);
+    pack_runs(runs, count, buf + EXTENT_BLOCK_HEADER);
 }
 
-char* get_file_path(const char* path) {
-    char* path_only = malloc(strlen(path) + 1);
-    if (path_only == NULL) {
-        return NULL;
+void pack_extent_index(const inode *i, int level, const uint32_t *first, const int *children, int count, char *buf) {
+    memset(buf, 0, block_size);
+    put_le32(buf + 0, EXTENT_BLOCK_MAGIC);
+    put_le32(buf + 4, (uint32_t)count);
+    put_le32(buf + 8, (uint32_t)i->number);
+    put_le32(buf + 12, (uint32_t)level);
+    for (int k = 0; k < count; k++) {
+        put_le32(buf + EXTENT_BLOCK_HEADER + EXTENT_INDEX_SIZE * k + 0, first[k]);
+        put_le32(buf + EXTENT_BLOCK_HEADER + EXTENT_INDEX_SIZE * k + 4, (uint32_t)children[k]);
     }
+}
 
-    char* last_slash = strrchr(path, '/');
-    if (last_slash != NULL) {
-        strncpy(path_only, path, last_slash - path);
-        path_only[last_slash - path] = '\0';
-    } else {
-        strcpy(path_only, path);
+// Directory entry record, stored at the same index as the inode:
+// parent inode number, link count, type, name length (le32), name
+size_t pack_dirent(const filetype *f, char *buf) {
+    memset(buf, 0, DIRENT_RECORD_SIZE);
+    size_t len = f->name_len;
+    if (len > DIRENT_NAME_LEN) {
+        len = DIRENT_NAME_LEN;
     }
+    put_le32(buf + 0, f->parent && f->parent->inum ? (uint32_t)f->parent->inum->number : 0);
+    put_le32(buf + 4, (uint32_t)f->num_links);
+    put_le32(buf + 8, f->type == NODE_DIRECTORY ? DIRENT_DIRECTORY : DIRENT_FILE);
+    put_le32(buf + 12, (uint32_t)len);
+    memcpy(buf + 16, node_name(f), len);
+    return DIRENT_RECORD_SIZE;
+}
 
-    if (strcmp(path_only, "") == 0) {
-        strcpy(path_only, "/");
+// Type and parent of an entry without copying the name, 0 for a free slot
+int peek_dirent(const char *buf, int *parent) {
+    int type = (int)get_le32(buf + 8);
+    if (type != DIRENT_FILE && type != DIRENT_DIRECTORY) {
+        return 0;
     }
+    *parent = (int)get_le32(buf + 0);
+    return type;
+}
 
-    return path_only;
-}
\ No newline at end of file
+// Returns the entry type (0 for a free slot) and the parent inode number
+int unpack_dirent(filetype *f, const char *buf, int *parent) {
+    int type = (int)get_le32(buf + 8);
+    if (type != DIRENT_FILE && type != DIRENT_DIRECTORY) {
+        return 0;
+    }
+    size_t len = get_le32(buf + 12);
+    if (len > DIRENT_NAME_LEN) {
+        len = DIRENT_NAME_LEN;
+    }
+    const char *end = memchr(buf + 16, '\0', len);
+    if (end != NULL) {
+        len = (size_t)(end - (buf + 16));
+    }
+    if (node_set_name(f, buf + 16, len) != 0) {
+        return 0;
+    }
+    *parent = (int)get_le32(buf + 0);
+    f->num_links = (int)get_le32(buf + 4);
+    f->type = type == DIRENT_DIRECTORY ? NODE_DIRECTORY : NODE_FILE;
+    f->valid = 1;
+    return type;
+}
+
+// Image header: magic, version, block size, block count (le32), superblock offset and
+// slot size (le64), slot count (le32), inode table and dirent offsets (le64) from offset 40,
+// inode count, record sizes, root inode (le32), snapshot offset (le64), snapshot slot count
+// (le32), then from offset 88 snapshot slot size, data offset and image size (le64).
+// Bytes 36 and 84 are unused, the rest of the IMAGE_HEADER_SIZE page is zero.
+void pack_image_header(const image_header *h, char *buf) {
+    memset(buf, 0, IMAGE_HEADER_SIZE);
+    put_le32(buf + 0, h->magic);
+    put_le32(buf + 4, h->version);
+    put_le32(buf + 8, h->data_block_size);
+    put_le32(buf + 12, h->block_count);
+    put_le64(buf + 16, h->superblock_offset);
+    put_le64(buf + 24, h->superblock_slot_size);
+    put_le32(buf + 32, h->superblock_slots);
+    put_le64(buf + 40, h->inode_table_offset);
+    put_le64(buf + 48, h->dirent_offset);
+    put_le32(buf + 56, h->inode_count);
+    put_le32(buf + 60, h->inode_record_size);
+    put_le32(buf + 64, h->dirent_record_size);
+    put_le32(buf + 68, h->root_inode);
+    put_le64(buf + 72, h->snapshot_offset);
+    put_le32(buf + 80, h->snapshot_slots);
+    put_le64(buf + 88, h->snapshot_slot_size);
+    put_le64(buf + 96, h->data_offset);
+    put_le64(buf + 104, h->image_size);
+}
+
+void unpack_image_header(image_header *h, const char *buf) {
+    h->magic = get_le32(buf + 0);
+    h->version = get_le32(buf + 4);
+    h->data_block_size = get_le32(buf + 8);
+    h->block_count = get_le32(buf + 12);
+    h->superblock_offset = get_le64(buf + 16);
+    h->superblock_slot_size = get_le64(buf + 24);
+    h->superblock_slots = get_le32(buf + 32);
+    h->inode_table_offset = get_le64(buf + 40);
+    h->dirent_offset = get_le64(buf + 48);
+    h->inode_count = get_le32(buf + 56);
+    h->inode_record_size = get_le32(buf + 60);
+    h->dirent_record_size = get_le32(buf + 64);
+    h->root_inode = get_le32(buf + 68);
+    h->snapshot_offset = get_le64(buf + 72);
+    h->snapshot_slots = get_le32(buf + 80);
+    h->snapshot_slot_size = get_le64(buf + 88);
+    h->data_offset = get_le64(buf + 96);
+    h->image_size = get_le64(buf + 104);
+}
+
+// Superblock slot header: sequence (le64), checksum, payload length (le32)
+void pack_superblock_slot(const superblock_slot *s, char *buf) {
+    put_le64(buf + 0, s->sequence);
+    put_le32(buf + 8, s->checksum);
+    put_le32(buf + 12, s->length);
+}
+
+void unpack_superblock_slot(superblock_slot *s, const char *buf) {
+    s->sequence = get_le64(buf + 0);
+    s->checksum = get_le32(buf + 8);
+    s->length = get_le32(buf + 12);
+}
+
+// CRC-32 (IEEE 802.3), used to validate journal records
+uint32_t crc32_buf(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    return ~crc;
+}